@@ -0,0 +1,313 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+#include <algorithm>
+
+ClusterCache::ClusterCache(const std::string &filename, MemoryMap &image_,
+                           DirtyMap &dirty_, size_t budget_)
+    : image(image_), dirty(dirty_), budget(budget_), residentBlocks(0) {
+    // Blocks are dropped with madvise, which works on whole pages
+    blockSize = sysconf(_SC_PAGESIZE);
+
+    state.resize((image.size + blockSize - 1) / blockSize, BLOCK_ABSENT);
+
+    fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        printf("Cannot open file for reading\n");
+        throw -1;
+    }
+
+    try {
+        uring = std::make_unique<IoUring>(64);
+    } catch (...) {
+        printf("Read image with pread\n");
+    }
+}
+
+ClusterCache::~ClusterCache() {
+    try {
+        drain();
+    } catch (...) {
+    }
+
+    // Reads still in flight must not outlive the file descriptor
+    uring.reset();
+    close(fd);
+}
+
+void ClusterCache::getBlocks(const CacheRange &range, size_t &first,
+                             size_t &last) {
+    size_t offset = range.ptr - image.data;
+
+    if (offset >= image.size || range.size > image.size - offset) {
+        printf("Range %zu, size %zu is outside of the image\n", offset,
+               range.size);
+        throw EFAULT;
+    }
+
+    first = offset / blockSize;
+    last = (offset + range.size - 1) / blockSize;
+}
+
+// Marks all missing blocks of the ranges as loading and returns them as runs
+// of adjacent blocks
+std::vector<ClusterCache::BlockRun>
+ClusterCache::startLoading(const std::vector<CacheRange> &ranges) {
+    std::vector<BlockRun> runs;
+
+    for (const CacheRange &range : ranges) {
+        if (!range.size) {
+            continue;
+        }
+
+        size_t first;
+        size_t last;
+        getBlocks(range, first, last);
+
+        for (size_t block = first; block <= last; block++) {
+            if (state[block] != BLOCK_ABSENT) {
+                continue;
+            }
+
+            state[block] = BLOCK_LOADING;
+            residentBlocks++;
+
+            if (!runs.empty() &&
+                runs.back().first + runs.back().count == block) {
+                runs.back().count++;
+            } else {
+                runs.push_back({block, 1});
+            }
+        }
+    }
+
+    return runs;
+}
+
+void ClusterCache::readBlocks(size_t first, size_t count) {
+    size_t offset = first * blockSize;
+    size_t size = std::min(count * blockSize, image.size - offset);
+    size_t hasRead = 0;
+
+    while (hasRead != size) {
+        ssize_t rd = pread(fd, image.data + offset + hasRead, size - hasRead,
+                           offset + hasRead);
+
+        if (rd <= 0) {
+            if (rd == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+
+            printf("Cannot read image at %zu, errno %d\n", offset + hasRead,
+                   rd == 0 ? 0 : errno);
+            throw EIO;
+        }
+
+        hasRead += (size_t)rd;
+    }
+}
+
+// Moves a run from loading to cached. Runs which were not read completely
+// are read again with pread
+void ClusterCache::finishLoading(size_t first, size_t count, bool complete) {
+    if (!complete) {
+        try {
+            readBlocks(first, count);
+        } catch (...) {
+            std::fill(state.begin() + first, state.begin() + first + count,
+                      BLOCK_ABSENT);
+            residentBlocks -= count;
+            throw;
+        }
+    }
+
+    for (size_t block = first; block < first + count; block++) {
+        state[block] = BLOCK_CACHED;
+        lru.push_front(block);
+        lruPos[block] = lru.begin();
+    }
+}
+
+void ClusterCache::reap() {
+    uint64_t userData;
+    int result;
+
+    while (uring && uring->complete(userData, result)) {
+        size_t first = userData;
+        size_t count = loading[first];
+        loading.erase(first);
+
+        size_t expected =
+            std::min(count * blockSize, image.size - first * blockSize);
+
+        finishLoading(first, count, result >= 0 && (size_t)result == expected);
+    }
+}
+
+void ClusterCache::waitOne() {
+    uring->submit(1);
+    reap();
+}
+
+void ClusterCache::drain() {
+    while (uring && uring->inflight) {
+        waitOne();
+    }
+}
+
+// Without mayBlock, runs which do not fit into the ring any more are dropped
+void ClusterCache::submit(const std::vector<BlockRun> &runs, bool mayBlock) {
+    for (const BlockRun &run : runs) {
+        if (!uring) {
+            finishLoading(run.first, run.count, false);
+            continue;
+        }
+
+        while (uring->full() && mayBlock) {
+            waitOne();
+        }
+
+        if (uring->full()) {
+            std::fill(state.begin() + run.first,
+                      state.begin() + run.first + run.count, BLOCK_ABSENT);
+            residentBlocks -= run.count;
+            continue;
+        }
+
+        size_t offset = run.first * blockSize;
+        size_t size = std::min(run.count * blockSize, image.size - offset);
+
+        uring->read(fd, image.data + offset, size, offset, run.first);
+        loading[run.first] = run.count;
+    }
+
+    if (uring) {
+        uring->submit(0);
+    }
+}
+
+void ClusterCache::evict(size_t keep) {
+    // The blocks in use right now are the first keep ones
+    size_t candidates = lru.size() - std::min(keep, lru.size());
+    auto it = lru.end();
+
+    while (residentBlocks * blockSize > budget && candidates) {
+        --it;
+        candidates--;
+
+        size_t block = *it;
+        uint8_t *ptr = image.data + block * blockSize;
+        size_t size = std::min(blockSize, image.size - block * blockSize);
+
+        // Changes only exist in memory until they are written back
+        if (dirty.test(ptr, size)) {
+            continue;
+        }
+
+        if (madvise(ptr, size, MADV_DONTNEED) != 0) {
+            printf("Cannot drop cached block %zu, errno %d\n", block, errno);
+            return;
+        }
+
+        state[block] = BLOCK_ABSENT;
+        lruPos.erase(block);
+        it = lru.erase(it);
+        residentBlocks--;
+    }
+}
+
+void ClusterCache::load(const uint8_t *ptr, size_t size, bool pin) {
+    load(std::vector<CacheRange>{{ptr, size}}, pin);
+}
+
+void ClusterCache::load(const std::vector<CacheRange> &ranges, bool pin) {
+    reap();
+    submit(startLoading(ranges), true);
+
+    // Blocks either just submitted or still in flight from a prefetch. All
+    // completions are in before the blocks are touched below, so that
+    // those end up in front of the list
+    for (const CacheRange &range : ranges) {
+        if (!range.size) {
+            continue;
+        }
+
+        size_t first;
+        size_t last;
+        getBlocks(range, first, last);
+
+        for (size_t block = first; block <= last; block++) {
+            while (state[block] == BLOCK_LOADING) {
+                waitOne();
+            }
+        }
+    }
+
+    size_t keep = 0;
+
+    for (const CacheRange &range : ranges) {
+        if (!range.size) {
+            continue;
+        }
+
+        size_t first;
+        size_t last;
+        getBlocks(range, first, last);
+
+        for (size_t block = first; block <= last; block++) {
+            if (state[block] != BLOCK_CACHED) {
+                continue;
+            }
+
+            if (pin) {
+                lru.erase(lruPos[block]);
+                lruPos.erase(block);
+                state[block] = BLOCK_PINNED;
+            } else {
+                lru.splice(lru.begin(), lru, lruPos[block]);
+                keep++;
+            }
+        }
+    }
+
+    evict(keep);
+}
+
+void ClusterCache::prefetch(const std::vector<CacheRange> &ranges) {
+    if (!uring) {
+        // Let the kernel read ahead into the page cache instead
+        for (const CacheRange &range : ranges) {
+            posix_fadvise(fd, range.ptr - image.data, range.size,
+                          POSIX_FADV_WILLNEED);
+        }
+
+        return;
+    }
+
+    // Room is made before the readahead counts as resident. Evicting after
+    // would drop the blocks just loaded for ones that may never be used
+    reap();
+    evict(0);
+    submit(startLoading(ranges), false);
+}
+
+void ClusterCache::reopen(const std::string &filename) {
+    drain();
+
+    int newFd = open(filename.c_str(), O_RDONLY);
+
+    if (newFd == -1) {
+        printf("Cannot reopen %s, errno %d\n", filename.c_str(), errno);
+        throw -1;
+    }
+
+    close(fd);
+    fd = newFd;
+}
@@ -0,0 +1,92 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "file.h"
+#include "uring.h"
+
+struct CacheRange {
+    const uint8_t *ptr;
+    size_t size;
+};
+
+// Fills an on-demand image mapping (see MAP_ON_DEMAND) from the image file.
+// The mapping is split into pages, which are read when first accessed and
+// dropped again in least recently used order once more than budget bytes
+// are resident. Reads go through io_uring if the kernel supports it and
+// through pread otherwise.
+//
+// Pointers into a block only stay valid until the next call to load, unless
+// the block is pinned or dirty -- neither is ever dropped. Pinned blocks
+// count towards the budget, so the budget is a soft limit
+class ClusterCache {
+  public:
+    ClusterCache(const std::string &filename, MemoryMap &image_,
+                 DirtyMap &dirty_, size_t budget_);
+    ~ClusterCache();
+
+    // Make [ptr, ptr + size) of the mapping resident
+    void load(const uint8_t *ptr, size_t size, bool pin = false);
+
+    // Make all ranges resident. Missing blocks are read with a single
+    // submission
+    void load(const std::vector<CacheRange> &ranges, bool pin = false);
+
+    // Start reading the ranges in the background, without waiting for them
+    void prefetch(const std::vector<CacheRange> &ranges);
+
+    // The image file was replaced (i.e. by a shadow copy), read from the new
+    // one from now on
+    void reopen(const std::string &filename);
+
+  private:
+    enum BlockState : uint8_t {
+        BLOCK_ABSENT,
+        BLOCK_LOADING,
+        BLOCK_CACHED,
+        BLOCK_PINNED
+    };
+
+    struct BlockRun {
+        size_t first;
+        size_t count;
+    };
+
+    int fd;
+    MemoryMap &image;
+    DirtyMap &dirty;
+    size_t budget;
+    size_t blockSize;
+    size_t residentBlocks;
+    std::vector<BlockState> state;
+
+    // Most recently used block first. Pinned and loading blocks are not part
+    // of it
+    std::list<size_t> lru;
+    std::unordered_map<size_t, std::list<size_t>::iterator> lruPos;
+
+    std::unique_ptr<IoUring> uring;
+
+    // Runs submitted to io_uring, by their first block
+    std::unordered_map<size_t, size_t> loading;
+
+    void getBlocks(const CacheRange &range, size_t &first, size_t &last);
+    std::vector<BlockRun> startLoading(const std::vector<CacheRange> &ranges);
+    void readBlocks(size_t first, size_t count);
+    void finishLoading(size_t first, size_t count, bool complete);
+    void submit(const std::vector<BlockRun> &runs, bool mayBlock);
+    void reap();
+    void waitOne();
+    void drain();
+    void evict(size_t keep);
+};
+
+#endif // CACHE_H
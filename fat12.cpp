@@ -1,8 +1,11 @@
 #include "fat12.h"
 #include "codepage.h"
+#include "image.h"
 #include "util.h"
 
 #include <assert.h>
+#include <endian.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -91,37 +94,49 @@ static void checkRootEntries(uint16_t rootEntries, uint16_t bytesPerSector) {
     }
 }
 
-static RegionBPB scanForBPBRegion(std::vector<uint8_t> &buffer) {
-    if (buffer.size() + 512 < buffer.size()) {
-        printf("File is too big. Possible overflow [%zu]", buffer.size());
-        throw -1;
-    }
+typedef uint8_t SectorHead __attribute__((vector_size(32)));
 
-    for (size_t i = 0; (i + 1) * 512 < buffer.size(); i++) {
+// Cheap test on the first 32 bytes of a sector, with all sectors that may be
+// valid passing it: a jump instruction (0xE9 or 0xEB), 512 to 4096 bytes
+// per sector and a media type from 0xF0 up
+static bool mayBeBootSector(const uint8_t *sector) {
+    static const SectorHead mask = {0xFD, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0xFF, 0xE1, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0xF0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    static const SectorHead expected = {0xE9, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0,    0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0xF0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-        try {
+    SectorHead head;
+    memcpy(&head, sector, sizeof(head));
 
-            BPB *bpb = (BPB *)(buffer.data() + (512 * i));
-            printf("[%zu] ", i);
+    SectorHead diff = (head & mask) ^ expected;
 
-            bpb->check();
+    uint64_t lanes[4];
+    memcpy(lanes, &diff, sizeof(lanes));
 
-            size_t reservedRegionSize =
-                (bpb->reservedSectors * bpb->bytesPerSector);
+    return !(lanes[0] | lanes[1] | lanes[2] | lanes[3]);
+}
+
+bool isBootSector(const uint8_t *sector) {
+    return ((const BPB *)sector)->isValid();
+}
 
-            size_t offset = (i * 512);
+size_t findBootSector(uint8_t *buffer, size_t size, size_t offset) {
+    if (size + 512 < size) {
+        printf("File is too big. Possible overflow [%zu]", size);
+        throw -1;
+    }
 
-            return {*bpb,
-                    {buffer.data() + (i * 512), offset, reservedRegionSize}};
+    for (size_t i = offset / 512; (i + 1) * 512 <= size; i++) {
+        const uint8_t *sector = buffer + (512 * i);
 
-        } catch (...) {
+        if (mayBeBootSector(sector) && isBootSector(sector)) {
+            return i * 512;
         }
     }
 
-    printf("\n");
-    printf("No valid location found\n");
-
-    throw -1;
+    return size;
 }
 
 UINT16LE::operator uint16_t() const { return le16toh(le); }
@@ -208,6 +223,46 @@ void FileEntry::getCanonicalNulTerm(char (&canonName)[8 + 1 + 3 + 1]) {
 
 void FileEntry::reset() { memset(this, 0x00, sizeof(*this)); }
 
+void Region::markDirty(const void *at, size_t sz) const {
+    if (dirty) {
+        dirty->mark(at, sz);
+    }
+}
+
+void Volume::markDirty(const void *at, size_t sz) const {
+    if (dirty) {
+        dirty->mark(at, sz);
+    }
+}
+
+// Same as check, without any output
+bool BPB::isValid() const {
+    uint16_t bps = bytesPerSector;
+    uint16_t entries = rootEntries;
+
+    if (!(jump[0] == 0xEB && jump[2] == 0x90) && jump[0] != 0xE9) {
+        return false;
+    }
+
+    if (bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) {
+        return false;
+    }
+
+    if (!sectorsPerCluster || (sectorsPerCluster & (sectorsPerCluster - 1))) {
+        return false;
+    }
+
+    if ((entries * 32) % bps) {
+        return false;
+    }
+
+    if (mediaType != 0xF0 && mediaType < 0xF8) {
+        return false;
+    }
+
+    return (driveNumber == 0x00 || driveNumber == 0x80) && !reserved;
+}
+
 void BPB::check() {
     checkJump(jump);
 
@@ -316,22 +371,372 @@ void FatEntry::setValue(uint16_t value) const {
         ptr[0] = value & 0b11111111;
         ptr[1] = (ptr[1] & 0b11110000) + ((value >> 8));
     }
+
+    if (dirty) {
+        dirty->mark(ptr, 2);
+    }
+}
+
+static FatEntry getFatEntry(const Region &regionFat, size_t i) {
+    return {regionFat.ptr + i * 12 / 8, (bool)(i % 2), regionFat.dirty};
+}
+
+// 16 entries take up 24 bytes, which are handled as four 64 bit lanes of 6
+// bytes (4 entries) each. The lanes are loaded with 8 bytes, so unpacking a
+// group reads 2 bytes past it
+typedef uint64_t FatLanes __attribute__((vector_size(32)));
+
+static const size_t groupEntries = 16;
+static const size_t groupBytes = 24;
+
+static void unpackGroup(const uint8_t *packed, uint16_t *entries) {
+    FatLanes lanes;
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t lane;
+        memcpy(&lane, packed + i * 6, sizeof(lane));
+        lanes[i] = le64toh(lane);
+    }
+
+    FatLanes unpacked = (lanes & 0xFFF) | ((lanes << 4) & 0xFFF0000ull) |
+                        ((lanes << 8) & 0xFFF00000000ull) |
+                        ((lanes << 12) & 0xFFF000000000000ull);
+
+    memcpy(entries, &unpacked, sizeof(unpacked));
+}
+
+static void packGroup(const uint16_t *entries, uint8_t *packed) {
+    FatLanes unpacked;
+    memcpy(&unpacked, entries, sizeof(unpacked));
+
+    FatLanes lanes = (unpacked & 0xFFF) | ((unpacked >> 4) & 0xFFF000ull) |
+                     ((unpacked >> 8) & 0xFFF000000ull) |
+                     ((unpacked >> 12) & 0xFFF000000000ull);
+
+    for (int i = 0; i < 4; i++) {
+        uint64_t lane = htole64(lanes[i]);
+        memcpy(packed + i * 6, &lane, 6);
+    }
+}
+
+// The lanes hold the entries in memory order only on little endian hosts,
+// everything else takes the scalar path
+static const bool vectorFat = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+FatTable::FatTable(const Region &region_, size_t fatSize_,
+                   uint16_t maxCluster_)
+    : region(region_), fatSize(fatSize_),
+      entries(std::min(fatSize * 8 / 12, (size_t)4096)),
+      dirtyGroups((entries.size() + groupEntries - 1) / groupEntries),
+      dirtyCount(0),
+      maxCluster(std::min((size_t)maxCluster_, entries.size())),
+      freeBits((maxCluster + 63) / 64), freeClusters(0), nextFree(2),
+      changes(0), cuts(0) {
+    size_t i = 0;
+
+    for (; vectorFat && i + groupEntries <= entries.size() &&
+           i / groupEntries * groupBytes + groupBytes + 2 <= fatSize;
+         i += groupEntries) {
+        unpackGroup(region.ptr + i / groupEntries * groupBytes, &entries[i]);
+    }
+
+    for (; i < entries.size(); i++) {
+        entries[i] = getFatEntry(region, i).getValue();
+    }
+
+    // Clusters 0 and 1 hold the media type
+    for (i = 2; i < maxCluster; i++) {
+        if (entries[i] == 0) {
+            freeBits[i / 64] |= 1ull << (i % 64);
+            freeClusters++;
+        }
+    }
+}
+
+uint16_t FatTable::get(uint16_t cluster) const {
+    return cluster < entries.size() ? entries[cluster] : 0xFFF;
+}
+
+void FatTable::set(uint16_t cluster, uint16_t value) {
+    if (cluster >= entries.size()) {
+        printf("FAT entry %hu is out of range\n", cluster);
+        throw EFAULT;
+    }
+
+    value &= 0xFFF;
+
+    if (cluster >= 2 && cluster < maxCluster &&
+        (entries[cluster] == 0) != (value == 0)) {
+        freeBits[cluster / 64] ^= 1ull << (cluster % 64);
+
+        if (value == 0) {
+            freeClusters++;
+        } else {
+            freeClusters--;
+        }
+    }
+
+    uint16_t previous = entries[cluster];
+
+    // Allocating a cluster and appending to the end of a chain is fine
+    if (previous != value && previous != 0 &&
+        (previous < 0xFF8 || value == 0)) {
+        cuts++;
+    }
+
+    entries[cluster] = value;
+    changes++;
+
+    size_t group = cluster / groupEntries;
+
+    if (!dirtyGroups[group]) {
+        dirtyGroups[group] = true;
+        dirtyCount++;
+    }
+}
+
+size_t FatTable::size() const { return entries.size(); }
+
+uint64_t FatTable::generation() const { return changes; }
+
+uint64_t FatTable::cutGeneration() const { return cuts; }
+
+// The first cluster in [from, to) which is free, or not free. to if there
+// is none
+size_t FatTable::findBit(size_t from, size_t to, bool free) const {
+    while (from < to) {
+        uint64_t bits = free ? freeBits[from / 64] : ~freeBits[from / 64];
+        bits &= ~0ull << (from % 64);
+
+        if (bits) {
+            return std::min(from / 64 * 64 + __builtin_ctzll(bits), to);
+        }
+
+        from = (from / 64 + 1) * 64;
+    }
+
+    return to;
+}
+
+uint16_t FatTable::findRun(size_t count, size_t &length) {
+    size_t best = 0xFFF;
+    length = 0;
+
+    // Runs do not wrap around, so from nextFree to the end first and then
+    // from the start up to it
+    size_t bounds[2][2] = {{nextFree, maxCluster}, {2, nextFree}};
+
+    for (auto &bound : bounds) {
+        size_t end = bound[0];
+
+        while (freeClusters && end < bound[1]) {
+            size_t start = findBit(end, bound[1], true);
+            end = findBit(start, bound[1], false);
+
+            if (end - start > length) {
+                best = start;
+                length = std::min(end - start, count);
+            }
+
+            if (length == count) {
+                nextFree = best + length;
+                return best;
+            }
+        }
+    }
+
+    if (length) {
+        nextFree = best + length;
+    }
+
+    return best;
+}
+
+uint16_t FatTable::findFree() {
+    size_t length;
+    return findRun(1, length);
+}
+
+uint16_t FatTable::allocate(uint16_t tail, size_t count) {
+    size_t length;
+    uint16_t first = findRun(std::max(count, (size_t)1), length);
+
+    if (first == 0xFFF) {
+        return 0xFFF;
+    }
+
+    for (size_t i = 0; i + 1 < length; i++) {
+        set(first + i, first + i + 1);
+    }
+
+    set(first + length - 1, 0xFFF);
+
+    if (tail) {
+        set(tail, first);
+    }
+
+    return first;
+}
+
+size_t FatTable::freeCount() const { return freeClusters; }
+
+bool FatTable::isDirty() const { return dirtyCount != 0; }
+
+// Packs the group into the first FAT and mirrors the bytes to the others
+void FatTable::pack(size_t group) {
+    size_t i = group * groupEntries;
+    uint8_t *packed = region.ptr + group * groupBytes;
+
+    if (vectorFat && i + groupEntries <= entries.size() &&
+        group * groupBytes + groupBytes <= fatSize) {
+        packGroup(&entries[i], packed);
+    } else {
+        for (; i < std::min((group + 1) * groupEntries, entries.size()); i++) {
+            FatEntry entry = getFatEntry(region, i);
+            entry.dirty = 0;
+            entry.setValue(entries[i]);
+        }
+    }
+
+    size_t size = std::min(groupBytes, fatSize - group * groupBytes);
+    region.markDirty(packed, size);
+
+    for (size_t copy = fatSize; copy + fatSize <= region.size;
+         copy += fatSize) {
+        memcpy(packed + copy, packed, size);
+        region.markDirty(packed + copy, size);
+    }
+}
+
+void FatTable::flush() {
+    for (size_t group = 0; dirtyCount && group < dirtyGroups.size(); group++) {
+        if (dirtyGroups[group]) {
+            pack(group);
+            dirtyGroups[group] = false;
+            dirtyCount--;
+        }
+    }
+}
+
+size_t getMetadataSize(BPB &bpb) {
+    return (size_t)bpb.reservedSectors * bpb.bytesPerSector +
+           (size_t)bpb.fatCount * bpb.sectorPerFat * bpb.bytesPerSector +
+           (size_t)bpb.rootEntries * 32;
+}
+
+size_t getVolumeSize(BPB &bpb) {
+    return (size_t)(bpb.totalSectors16 ? bpb.totalSectors16
+                                       : bpb.totalSectors32) *
+           bpb.bytesPerSector;
+}
+
+bool isWithinVolumes(const uint8_t *data, const std::vector<size_t> &volumes,
+                     size_t offset) {
+    for (size_t volume : volumes) {
+        if (offset >= volume &&
+            offset - volume < getVolumeSize(*(BPB *)(data + volume))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+std::vector<size_t> findVolumes(uint8_t *data, size_t size) {
+    std::vector<size_t> volumes;
+
+    for (size_t candidate : getVolumeCandidates(data, size, size)) {
+        if (isBootSector(data + candidate) &&
+            !isWithinVolumes(data, volumes, candidate)) {
+            volumes.push_back(candidate);
+        }
+    }
+
+    if (!volumes.empty()) {
+        return volumes;
+    }
+
+    printf("No volume at the start of the image or in its partition "
+           "table -- scan image\n");
+
+    for (size_t offset = findBootSector(data, size); offset != size;
+         offset = findBootSector(data, size, offset)) {
+        volumes.push_back(offset);
+
+        // Skip the volume, so files in it looking like boot sectors are not
+        // taken for volumes of their own
+        offset += std::max(getVolumeSize(*(BPB *)(data + offset)),
+                           (size_t)512);
+        offset = std::min((offset + 511) / 512 * 512, size);
+    }
+
+    return volumes;
+}
+
+std::vector<Fat12Volume> getFatVolumes(uint8_t *data, size_t size,
+                                       DirtyMap *dirty) {
+    std::vector<Fat12Volume> fat12Volumes;
+
+    // A broken volume should not keep the others from being used
+    for (size_t bootOffset : findVolumes(data, size)) {
+        try {
+            fat12Volumes.push_back(
+                getFatVolumeAt(data, size, bootOffset, dirty));
+        } catch (int) {
+            printf("Skip volume at 0x%zX\n", bootOffset);
+        }
+    }
+
+    if (fat12Volumes.empty()) {
+        printf("\n");
+        printf("No valid location found\n");
+        throw -1;
+    }
+
+    return fat12Volumes;
+}
+
+Fat12Volume getFatVolume(uint8_t *data, size_t size, DirtyMap *dirty) {
+    size_t bootOffset = size;
+
+    for (size_t candidate : getVolumeCandidates(data, size, size)) {
+        if (isBootSector(data + candidate)) {
+            bootOffset = candidate;
+            break;
+        }
+    }
+
+    if (bootOffset == size) {
+        printf("No volume at the start of the image or in its partition "
+               "table -- scan image\n");
+        bootOffset = findBootSector(data, size);
+    }
+
+    if (bootOffset == size) {
+        printf("\n");
+        printf("No valid location found\n");
+        throw -1;
+    }
+
+    return getFatVolumeAt(data, size, bootOffset, dirty);
 }
 
-Fat12Volume getFatVolume(std::vector<uint8_t> &filedata) {
+Fat12Volume getFatVolumeAt(uint8_t *data, size_t size, size_t bootOffset,
+                           DirtyMap *dirty) {
     // Volume starts here as well
-    const auto &regionBPB = scanForBPBRegion(filedata);
-    const auto &bpb = regionBPB.bootBlock;
+    BPB &bpb = *(BPB *)(data + bootOffset);
+    bpb.check();
 
-    size_t bootOffset = regionBPB.region.offset;
+    RegionBPB regionBPB{
+        bpb,
+        {data + bootOffset, bootOffset,
+         (size_t)bpb.reservedSectors * bpb.bytesPerSector, 0}};
 
-    size_t volumeSize = bpb.totalSectors16
-                            ? bpb.totalSectors16 * bpb.bytesPerSector
-                            : bpb.totalSectors32 * bpb.bytesPerSector;
+    size_t volumeSize = getVolumeSize(bpb);
 
-    Volume volume{filedata.data() + regionBPB.region.offset, volumeSize};
+    Volume volume{data + regionBPB.region.offset, volumeSize, dirty};
 
-    size_t remainingBufferSize = filedata.size() - bootOffset;
+    size_t remainingBufferSize = size - bootOffset;
 
     printf("Volume starts at 0x%zX, size 0x%zX\n", bootOffset, volumeSize);
     printf("Remaining buffer size %zX\n", remainingBufferSize);
@@ -349,14 +754,15 @@ Fat12Volume getFatVolume(std::vector<uint8_t> &filedata) {
 
     checkFatTable(volume, fatOffset, fatSize, bpb.fatCount);
 
-    Region fatRegion{volume.buffer + fatOffset, fatOffset, fatRegionSize};
+    Region fatRegion{volume.buffer + fatOffset, fatOffset, fatRegionSize,
+                     dirty};
     printf("Fat Region 0x%zX, size %zX\n", fatRegion.offset, fatRegion.size);
 
     const size_t rootDirOffset = fatRegion.offset + fatRegion.size;
     const size_t rootDirSize = bpb.rootEntries * 32;
 
     Region rootDirRegion{volume.buffer + rootDirOffset, rootDirOffset,
-                         rootDirSize};
+                         rootDirSize, dirty};
     printf("Root Region 0x%zX, size %zX\n", rootDirRegion.offset,
            rootDirRegion.size);
 
@@ -364,7 +770,7 @@ Fat12Volume getFatVolume(std::vector<uint8_t> &filedata) {
     const size_t dataSize =
         volumeSize - fatRegionSize - rootDirSize - regionBPB.region.size;
 
-    Region dataRegion{volume.buffer + dataOffset, dataOffset, dataSize};
+    Region dataRegion{volume.buffer + dataOffset, dataOffset, dataSize, dirty};
     printf("Data Region 0x%zX, size %zX\n", dataRegion.offset, dataRegion.size);
 
     size_t clusterSize = bpb.sectorsPerCluster * bpb.bytesPerSector;
@@ -379,29 +785,10 @@ Fat12Volume getFatVolume(std::vector<uint8_t> &filedata) {
 
     // TODO: Check if fat table contains eny clusters > MaxCluster
 
-    return {volume,     regionBPB,   fatRegion, rootDirRegion,
-            dataRegion, clusterSize, maxCluster};
-}
-
-void syncFAT(BPB &bootBlock, Volume &volume) {
+    FatTable fat(fatRegion, fatSize, maxCluster);
 
-    const size_t fatOffset = ((uint16_t)bootBlock.reservedSectors *
-                              (uint16_t)bootBlock.bytesPerSector);
-    const size_t fatSize =
-        (uint16_t)bootBlock.sectorPerFat * (uint16_t)bootBlock.bytesPerSector;
-
-    for (uint8_t i = 0; i < bootBlock.fatCount - 1; i++) {
-
-        size_t curFatOffsetIP0 = fatOffset + i * fatSize;
-        size_t curFatOffsetIP1 = fatOffset + (i + 1) * fatSize;
-
-        printf("Sync fat FAT %hhu with %d\n", i, i + 1);
-
-        memcpy(volume.buffer + curFatOffsetIP1, volume.buffer + curFatOffsetIP0,
-               fatSize);
-    }
-
-    printf("Synced fat tables\n");
+    return {volume,      regionBPB,  fatRegion, rootDirRegion, dataRegion,
+            clusterSize, maxCluster, fat};
 }
 
 static void leftPad(uint32_t padCount) { printf("%*s", padCount, ""); }
@@ -444,14 +831,7 @@ void printFileEntry(FileEntry &entry, uint32_t padding) {
     }
 };
 
-static FatEntry getFatEntry(Region &regionFat, uint16_t i) {
-    uint32_t idx = ((uint32_t)i * 12) / 8;
-    bool odd = (i % 2);
-
-    return {regionFat.ptr + idx, odd};
-};
-
-static void printDirectoryRecursive(Region &fatRegion, Region &dataRegion,
+static void printDirectoryRecursive(FatTable &fat, Region &dataRegion,
                                     FileEntry *file, size_t clusterSize,
                                     uint32_t depth) {
     uint16_t clusterNumber = file->firstDataClusterLow;
@@ -472,16 +852,16 @@ static void printDirectoryRecursive(Region &fatRegion, Region &dataRegion,
             if (entry->isValid() && entry->isDirectory() &&
                 !entry->isDotOrDotDot()) {
 
-                printDirectoryRecursive(fatRegion, dataRegion, entry,
-                                        clusterSize, depth + 1);
+                printDirectoryRecursive(fat, dataRegion, entry, clusterSize,
+                                        depth + 1);
             }
         }
 
-        clusterNumber = getFatEntry(fatRegion, clusterNumber).getValue();
+        clusterNumber = fat.get(clusterNumber);
     }
 }
 
-void printRootDirectoryRecursive(Region &fatRegion, Region &dataRegion,
+void printRootDirectoryRecursive(FatTable &fat, Region &dataRegion,
                                  uint8_t *rootRegionBuffer, uint16_t entries,
                                  size_t clusterSize) {
     for (uint16_t i = 0; i < entries; i++) {
@@ -491,8 +871,7 @@ void printRootDirectoryRecursive(Region &fatRegion, Region &dataRegion,
         printFileEntry(*entry, 0);
 
         if (entry->isValid() && entry->isDirectory()) {
-            printDirectoryRecursive(fatRegion, dataRegion, entry, clusterSize,
-                                    1);
+            printDirectoryRecursive(fat, dataRegion, entry, clusterSize, 1);
         }
     }
 }
@@ -6,6 +6,10 @@
 #include <string>
 #include <vector>
 
+#include "file.h"
+
+class ClusterCache;
+
 struct UINT16LE {
     uint16_t le;
 
@@ -61,15 +65,27 @@ struct __attribute__((__packed__)) FileEntry {
     void reset();
 };
 
+// dirty is optional. If set, every modification done through the region
+// (or through pointers into it) should be recorded there. The same goes for
+// cache -- if set, the region is not completely in memory and every range
+// needs to be loaded through the cache before it is accessed
+
 struct Region {
     uint8_t *ptr;
     size_t offset;
     size_t size;
+    DirtyMap *dirty;
+    ClusterCache *cache = 0;
+
+    void markDirty(const void *at, size_t sz) const;
 };
 
 struct Volume {
     uint8_t *buffer;
     size_t size;
+    DirtyMap *dirty;
+
+    void markDirty(const void *at, size_t sz) const;
 };
 
 struct __attribute__((__packed__)) BPB {
@@ -97,6 +113,7 @@ struct __attribute__((__packed__)) BPB {
     uint8_t signature[2];
 
     void check();
+    bool isValid() const;
 };
 
 struct RegionBPB {
@@ -107,11 +124,74 @@ struct RegionBPB {
 struct FatEntry {
     uint8_t *ptr;
     bool odd;
+    DirtyMap *dirty;
 
     uint16_t getValue() const;
     void setValue(uint16_t value) const;
 };
 
+// Decoded copy of the first FAT, one uint16_t per entry, so that walking a
+// chain does not need to pick the 12 bit entries out of the packed bytes.
+// Changes are packed back into the region by flush, but only for the groups
+// of 16 entries (24 bytes) they were done in. These are copied into the
+// other FATs of the region as well, which are expected to match the first
+// (see checkFatTable). Entries past the end of the FAT read as 0xFFF.
+//
+// The free clusters below maxCluster are kept in a bitmap as well, which is
+// searched from where the last search stopped (next fit)
+class FatTable {
+  public:
+    FatTable(const Region &region_, size_t fatSize_, uint16_t maxCluster_);
+
+    uint16_t get(uint16_t cluster) const;
+    void set(uint16_t cluster, uint16_t value);
+
+    // Number of entries in the FAT
+    size_t size() const;
+
+    // Changes with every set, for anything derived from the chains
+    uint64_t generation() const;
+
+    // Only changes when a chain is cut, i.e. an entry is freed or an entry
+    // linking to another cluster is changed. Positions within a chain stay
+    // valid until then, as chains are only appended to otherwise
+    uint64_t cutGeneration() const;
+
+    // A free cluster, or 0xFFF if there is none. The cluster stays free
+    // until it is set
+    uint16_t findFree();
+    size_t freeCount() const;
+
+    // First cluster of the next run of at least count free clusters, or of
+    // the longest run if there is none that long. length is set to the
+    // clusters of the run to use, at most count
+    uint16_t findRun(size_t count, size_t &length);
+
+    // Chains a run of up to count free clusters (see findRun) and appends it
+    // to tail, unless tail is 0. Returns the first cluster of the run, or
+    // 0xFFF if the volume is full
+    uint16_t allocate(uint16_t tail, size_t count);
+
+    bool isDirty() const;
+    void flush();
+
+  private:
+    Region region;
+    size_t fatSize;
+    std::vector<uint16_t> entries;
+    std::vector<bool> dirtyGroups;
+    size_t dirtyCount;
+    uint16_t maxCluster;
+    std::vector<uint64_t> freeBits;
+    size_t freeClusters;
+    size_t nextFree;
+    uint64_t changes;
+    uint64_t cuts;
+
+    void pack(size_t group);
+    size_t findBit(size_t from, size_t to, bool free) const;
+};
+
 struct Fat12Volume {
     Volume volume;
     RegionBPB regionBPB;
@@ -120,15 +200,42 @@ struct Fat12Volume {
     Region dataRegion;
     size_t clusterSize;
     uint16_t maxCluster;
+    FatTable fat;
 };
 
-Fat12Volume getFatVolume(std::vector<uint8_t> &filedata);
+bool isBootSector(const uint8_t *sector);
+
+// Offset of the first valid boot sector at or after offset, or size if
+// there is none. Only sectors passing a vectorized test of their first bytes
+// are validated completely
+size_t findBootSector(uint8_t *data, size_t size, size_t offset = 0);
+
+// Size of the boot sector, FAT and root regions, up to the data region
+size_t getMetadataSize(BPB &bpb);
+
+size_t getVolumeSize(BPB &bpb);
+
+// Whether offset lies within one of the volumes starting at the given offsets
+bool isWithinVolumes(const uint8_t *data, const std::vector<size_t> &volumes,
+                     size_t offset);
+
+// Offsets of all volumes in the image, in the order of the partition tables.
+// Only if those do not lead to any volume, the image is scanned
+std::vector<size_t> findVolumes(uint8_t *data, size_t size);
+
+// The first volume only
+Fat12Volume getFatVolume(uint8_t *data, size_t size, DirtyMap *dirty = 0);
+
+std::vector<Fat12Volume> getFatVolumes(uint8_t *data, size_t size,
+                                       DirtyMap *dirty = 0);
 
-void syncFAT(BPB &bootBlock, Volume &volume);
+// bootOffset needs to point to a boot sector found by findBootSector
+Fat12Volume getFatVolumeAt(uint8_t *data, size_t size, size_t bootOffset,
+                           DirtyMap *dirty = 0);
 
 void printFileEntry(FileEntry &entry, uint32_t padding);
 
-void printRootDirectoryRecursive(Region &fatRegion, Region &dataRegion,
+void printRootDirectoryRecursive(FatTable &fat, Region &dataRegion,
                                  uint8_t *rootRegionBuffer, uint16_t entries,
                                  size_t clusterSize);
 
@@ -7,9 +7,12 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
-#include <vector>
+#include <algorithm>
 
 FileDescriptorRO::FileDescriptorRO(const char *filename) {
     fd = open(filename, O_RDONLY);
@@ -34,37 +37,154 @@ FileDescriptorWO::FileDescriptorWO(const char *filename) {
 
 FileDescriptorWO::~FileDescriptorWO() { close(fd); }
 
-std::vector<uint8_t> getBuffer(int fd) {
+MemoryMap::MemoryMap(int fd, MapMode mode) {
     struct stat statbuf;
     if (fstat(fd, &statbuf) != 0) {
         printf("Cannot open file\n");
         throw -1;
     }
 
-    std::vector<uint8_t> buf(statbuf.st_size);
+    size = statbuf.st_size;
 
-    ssize_t hasRead = read(fd, buf.data(), buf.size());
-
-    if (hasRead == -1) {
-        printf("Cannot read from file\n");
+    if (size == 0) {
+        // mmap does not accept a zero length
+        printf("File is empty\n");
         throw -1;
     }
 
-    if ((size_t)hasRead != buf.size()) {
-        printf("Short read from file\n");
+    int prot = PROT_READ;
+    int flags = MAP_SHARED;
+
+    if (mode == MAP_COPY_ON_WRITE) {
+        prot |= PROT_WRITE;
+        flags = MAP_PRIVATE;
+    } else if (mode == MAP_ON_DEMAND) {
+        prot |= PROT_WRITE;
+        flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+        fd = -1;
+    }
+
+    void *addr = mmap(0, size, prot, flags, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        printf("Cannot map file, errno %d\n", errno);
         throw -1;
     }
 
-    return buf;
+    data = (uint8_t *)addr;
+}
+
+MemoryMap::~MemoryMap() { munmap(data, size); }
+
+bool pumpBuffer(const uint8_t *buffer, size_t size, int fd) {
+
+    size_t hasWritten = 0;
+
+    while (hasWritten != size) {
+        ssize_t written = write(fd, buffer + hasWritten, size - hasWritten);
+
+        if (written <= 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                return false;
+            }
+        } else {
+            hasWritten += (size_t)written;
+        }
+    }
+
+    return true;
+}
+
+DirtyMap::DirtyMap(const uint8_t *base_, size_t size_, size_t blockSize_)
+    : base(base_), size(size_), blockSize(blockSize_), dirtyBlocks(0),
+      bits((size_ / blockSize_ + 1 + 63) / 64, 0) {}
+
+void DirtyMap::mark(const void *ptr, size_t sz) {
+    if (!sz) {
+        return;
+    }
+
+    size_t offset = (const uint8_t *)ptr - base;
+
+    if (offset >= size || sz > size - offset) {
+        printf("Dirty range %zu, size %zu is outside of the image\n", offset,
+               sz);
+        throw EFAULT;
+    }
+
+    size_t first = offset / blockSize;
+    size_t last = (offset + sz - 1) / blockSize;
+
+    for (size_t block = first; block <= last; block++) {
+        uint64_t bit = (uint64_t)1 << (block % 64);
+
+        if (!(bits[block / 64] & bit)) {
+            bits[block / 64] |= bit;
+            dirtyBlocks++;
+        }
+    }
 }
 
-bool pumpBuffer(std::vector<uint8_t> &buffer, int fd) {
+bool DirtyMap::test(const void *ptr, size_t sz) const {
+    size_t offset = (const uint8_t *)ptr - base;
+
+    if (!sz || offset >= size) {
+        return false;
+    }
+
+    size_t first = offset / blockSize;
+    size_t last = (offset + std::min(sz, size - offset) - 1) / blockSize;
+
+    for (size_t block = first; block <= last; block++) {
+        if (bits[block / 64] & ((uint64_t)1 << (block % 64))) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool DirtyMap::empty() const { return dirtyBlocks == 0; }
+
+size_t DirtyMap::dirtyBytes() const { return dirtyBlocks * blockSize; }
 
+std::vector<DirtyRange> DirtyMap::getRanges() const {
+    std::vector<DirtyRange> ranges;
+
+    for (size_t i = 0; i < bits.size(); i++) {
+        uint64_t word = bits[i];
+
+        while (word) {
+            size_t block = i * 64 + __builtin_ctzll(word);
+            word &= word - 1;
+
+            size_t offset = block * blockSize;
+            size_t sz = std::min(blockSize, size - offset);
+
+            // Coalesce adjacent blocks into one range
+            if (!ranges.empty() &&
+                ranges.back().offset + ranges.back().size == offset) {
+                ranges.back().size += sz;
+            } else {
+                ranges.push_back({offset, sz});
+            }
+        }
+    }
+
+    return ranges;
+}
+
+void DirtyMap::clear() {
+    std::fill(bits.begin(), bits.end(), 0);
+    dirtyBlocks = 0;
+}
+
+bool pwriteBuffer(const uint8_t *buffer, size_t size, size_t offset, int fd) {
     size_t hasWritten = 0;
 
-    while (hasWritten != buffer.size()) {
-        ssize_t written =
-            write(fd, buffer.data() + hasWritten, buffer.size() - hasWritten);
+    while (hasWritten != size) {
+        ssize_t written = pwrite(fd, buffer + hasWritten, size - hasWritten,
+                                 offset + hasWritten);
 
         if (written <= 0) {
             if (errno != EAGAIN && errno != EINTR) {
@@ -76,4 +196,144 @@ bool pumpBuffer(std::vector<uint8_t> &buffer, int fd) {
     }
 
     return true;
-}
\ No newline at end of file
+}
+
+bool writeRanges(const uint8_t *buffer, const std::vector<DirtyRange> &ranges,
+                 int fd) {
+    for (const DirtyRange &range : ranges) {
+        if (!pwriteBuffer(buffer + range.offset, range.size, range.offset,
+                          fd)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Copy through user space, for when the kernel cannot copy between the two
+// files by itself
+static bool copyFile(int srcFd, int dstFd, size_t size) {
+    std::vector<uint8_t> chunk(1024 * 1024);
+
+    for (size_t offset = 0; offset != size;) {
+        ssize_t rd = pread(srcFd, chunk.data(),
+                           std::min(chunk.size(), size - offset), offset);
+
+        if (rd <= 0) {
+            if (rd == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+
+            return false;
+        }
+
+        if (!pwriteBuffer(chunk.data(), (size_t)rd, offset, dstFd)) {
+            return false;
+        }
+
+        offset += (size_t)rd;
+    }
+
+    return true;
+}
+
+// Make dstFd an exact copy of srcFd without moving the data through user
+// space. On filesystems supporting reflinks this shares all extents and
+// costs next to nothing
+static bool cloneFile(int srcFd, int dstFd, size_t size) {
+    if (ioctl(dstFd, FICLONE, srcFd) == 0) {
+        return true;
+    }
+
+    if (ftruncate(dstFd, 0) != 0) {
+        return false;
+    }
+
+    loff_t inOffset = 0;
+    loff_t outOffset = 0;
+
+    while ((size_t)inOffset != size) {
+        ssize_t copied = copy_file_range(srcFd, &inOffset, dstFd, &outOffset,
+                                         size - inOffset, 0);
+
+        if (copied <= 0) {
+            if (copied == -1 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL ||
+                                 errno == ENOSYS || errno == EOPNOTSUPP)) {
+                return ftruncate(dstFd, 0) == 0 && copyFile(srcFd, dstFd, size);
+            }
+
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void syncDirectory(const std::string &filename) {
+    size_t slash = filename.find_last_of('/');
+    std::string dir = slash == std::string::npos
+                          ? std::string(".")
+                          : filename.substr(0, std::max((size_t)1, slash));
+
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+
+    if (fd == -1) {
+        printf("Cannot open directory %s for syncing\n", dir.c_str());
+        return;
+    }
+
+    fsync(fd);
+    close(fd);
+}
+
+bool writeBackImage(const std::string &filename, const uint8_t *buffer,
+                    size_t size, DirtyMap &dirty) {
+    if (dirty.empty()) {
+        printf("No changes -- image is left untouched\n");
+        return true;
+    }
+
+    const auto &ranges = dirty.getRanges();
+    printf("Write back %zu bytes in %zu ranges\n", dirty.dirtyBytes(),
+           ranges.size());
+
+    // The original image is replaced atomically by a shadow copy, so a crash
+    // at any point leaves either the old or the new image behind. The copy
+    // is cloned from the current image (which may already be the result of
+    // an earlier write back) and only the changed ranges are written
+    std::string shadowFilename = filename + ".shadow";
+
+    {
+        FileDescriptorRO fdro(filename.c_str());
+        FileDescriptorWO fdwo(shadowFilename.c_str());
+
+        // The buffer does not necessarily hold the complete image (see
+        // MAP_ON_DEMAND), so the unchanged parts always come from the file
+        if (!cloneFile(fdro.fd, fdwo.fd, size)) {
+            printf("Cannot copy image to shadow file, errno %d\n", errno);
+            return false;
+        }
+
+        if (!writeRanges(buffer, ranges, fdwo.fd) || fsync(fdwo.fd) != 0) {
+            printf("Could not write shadow file\n");
+            return false;
+        }
+    }
+
+    if (rename(shadowFilename.c_str(), filename.c_str()) != 0) {
+        printf("Cannot replace image with shadow file, errno %d\n", errno);
+        return false;
+    }
+
+    // Otherwise the rename may be lost on a power failure, even though the
+    // changes already count as written
+    syncDirectory(filename);
+
+    dirty.clear();
+
+    return true;
+}
@@ -1,7 +1,10 @@
 #ifndef FILE_H
 #define FILE_H
 
+#include <stddef.h>
 #include <stdint.h>
+
+#include <string>
 #include <vector>
 
 class FileDescriptorRO {
@@ -20,7 +23,58 @@ class FileDescriptorWO {
     ~FileDescriptorWO();
 };
 
-std::vector<uint8_t> getBuffer(int fd);
-bool pumpBuffer(std::vector<uint8_t> &buffer, int fd);
+enum MapMode {
+    // Private, writable pages -- changes never reach the file by themselves
+    MAP_COPY_ON_WRITE,
+    // Shared, read-only pages -- backed by the page cache of the file
+    MAP_READ_ONLY,
+    // Private, writable pages without any content. Only address space is
+    // reserved, the data is filled in by a ClusterCache as it is needed
+    MAP_ON_DEMAND
+};
+
+class MemoryMap {
+  public:
+    uint8_t *data;
+    size_t size;
+
+    MemoryMap(int fd, MapMode mode);
+    ~MemoryMap();
+};
+
+struct DirtyRange {
+    size_t offset;
+    size_t size;
+};
+
+// Tracks which blocks of an image mapping were modified, so that only those
+// have to be written back. Offsets are relative to the start of the mapping
+class DirtyMap {
+  public:
+    const uint8_t *base;
+    size_t size;
+    size_t blockSize;
+    size_t dirtyBlocks;
+    std::vector<uint64_t> bits;
+
+    DirtyMap(const uint8_t *base_, size_t size_, size_t blockSize_ = 512);
+
+    void mark(const void *ptr, size_t sz);
+    bool test(const void *ptr, size_t sz) const;
+    bool empty() const;
+    size_t dirtyBytes() const;
+    std::vector<DirtyRange> getRanges() const;
+    void clear();
+};
+
+// Make a creation / removal of a file in the directory durable
+void syncDirectory(const std::string &filename);
+
+bool pumpBuffer(const uint8_t *buffer, size_t size, int fd);
+bool pwriteBuffer(const uint8_t *buffer, size_t size, size_t offset, int fd);
+bool writeRanges(const uint8_t *buffer, const std::vector<DirtyRange> &ranges,
+                 int fd);
+bool writeBackImage(const std::string &filename, const uint8_t *buffer,
+                    size_t size, DirtyMap &dirty);
 
 #endif // FILE_H
@@ -0,0 +1,347 @@
+// Measures the throughput of the hot paths in fat12.cpp on synthetic data
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "fat12.h"
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t bytes, double seconds) {
+    printf("%-32s %8.2f GB/s\n", name, bytes / seconds / 1e9);
+}
+
+static void reportEntries(const char *name, size_t entries, double seconds) {
+    printf("%-32s %8.2f M entries/s\n", name, entries / seconds / 1e6);
+}
+
+// Best of a few runs, to keep page faults and frequency scaling out of it
+template <typename F> static double measure(F func) {
+    double best = 1e9;
+
+    for (int i = 0; i < 3; i++) {
+        double start = now();
+        func();
+        best = std::min(best, now() - start);
+    }
+
+    return best;
+}
+
+// For code printing its progress, which would otherwise be measured as well
+template <typename F> static void withoutOutput(F func) {
+    fflush(stdout);
+
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+
+    if (saved == -1 || null == -1 || dup2(null, STDOUT_FILENO) == -1) {
+        printf("Cannot redirect output\n");
+        throw -1;
+    }
+
+    close(null);
+
+    func();
+
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static void fillBootSector(uint8_t *sector) {
+    BPB bpb;
+    memset(&bpb, 0, sizeof(bpb));
+
+    bpb.jump[0] = 0xEB;
+    bpb.jump[1] = 0x3C;
+    bpb.jump[2] = 0x90;
+    bpb.bytesPerSector = 1024;
+    bpb.sectorsPerCluster = 2;
+    bpb.reservedSectors = 1;
+    bpb.fatCount = 2;
+    bpb.rootEntries = 192;
+    bpb.totalSectors16 = 8000;
+    bpb.mediaType = 0xF8;
+    bpb.sectorPerFat = 6;
+    bpb.signature[0] = 0x55;
+    bpb.signature[1] = 0xAA;
+
+    memcpy(sector, &bpb, sizeof(bpb));
+}
+
+// The boot sector sits in the last sector, so every scan has to go through
+// the complete buffer
+static void benchScan(const char *name, std::vector<uint8_t> &buffer) {
+    size_t bootOffset = buffer.size() - 512;
+    fillBootSector(buffer.data() + bootOffset);
+
+    size_t found = 0;
+
+    double prefiltered = measure(
+        [&] { found = findBootSector(buffer.data(), buffer.size()); });
+
+    if (found != bootOffset) {
+        printf("Boot sector found at %zu instead of %zu\n", found, bootOffset);
+        throw -1;
+    }
+
+    double unfiltered = measure([&] {
+        for (found = 0; found < buffer.size(); found += 512) {
+            if (isBootSector(buffer.data() + found)) {
+                break;
+            }
+        }
+    });
+
+    if (found != bootOffset) {
+        printf("Boot sector found at %zu instead of %zu\n", found, bootOffset);
+        throw -1;
+    }
+
+    // How the scan was done before: complete validation of every sector,
+    // with exceptions for each miss
+    double checked = 0;
+
+    withoutOutput([&] {
+        checked = measure([&] {
+            for (found = 0; found < buffer.size(); found += 512) {
+                try {
+                    ((BPB *)(buffer.data() + found))->check();
+                    break;
+                } catch (...) {
+                }
+            }
+        });
+    });
+
+    printf("%s\n", name);
+    report("  findBootSector", buffer.size(), prefiltered);
+    report("  isBootSector on every sector", buffer.size(), unfiltered);
+    report("  BPB::check on every sector", buffer.size(), checked);
+}
+
+static FatEntry getPackedEntry(uint8_t *fat, size_t i) {
+    return {fat + i * 12 / 8, (bool)(i % 2), 0};
+}
+
+// A FAT of 12 sectors, with all clusters in one chain of random order. Each
+// operation runs on the packed bytes through FatEntry and on FatTable
+static void benchFat(uint64_t &state) {
+    const size_t fatSize = 12 * 512;
+    const size_t count = fatSize * 8 / 12;
+    const size_t rounds = 2000;
+
+    std::vector<uint8_t> fat(fatSize);
+    std::vector<uint16_t> order;
+
+    for (size_t i = 2; i < count; i++) {
+        order.push_back(i);
+    }
+
+    for (size_t i = order.size() - 1; i > 0; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        std::swap(order[i], order[state % (i + 1)]);
+    }
+
+    for (size_t i = 0; i + 1 < order.size(); i++) {
+        getPackedEntry(fat.data(), order[i]).setValue(order[i + 1]);
+    }
+
+    getPackedEntry(fat.data(), order.back()).setValue(0xFFF);
+
+    Region region = {fat.data(), 0, fatSize, 0};
+    size_t sum = 0;
+
+    // Each round starts somewhere else in the chain, so that the rounds
+    // cannot be folded into one
+    size_t walked = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        walked += order.size() - r * 7919 % order.size();
+    }
+
+    double packedWalk = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            for (uint16_t c = order[r * 7919 % order.size()]; c < 0xFF8;
+                 c = getPackedEntry(fat.data(), c).getValue()) {
+                sum++;
+            }
+        }
+    });
+
+    FatTable table(region, fatSize, count);
+
+    double tableWalk = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            for (uint16_t c = order[r * 7919 % order.size()]; c < 0xFF8;
+                 c = table.get(c)) {
+                sum++;
+            }
+        }
+    });
+
+    double packedUnpack = measure([&] {
+        std::vector<uint16_t> entries(count);
+
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < count; i++) {
+                entries[i] = getPackedEntry(fat.data(), i).getValue();
+            }
+
+            sum += entries[r % count];
+        }
+    });
+
+    double tableUnpack = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            FatTable decoded(region, fatSize, count);
+            sum += decoded.get(r % count);
+        }
+    });
+
+    std::vector<uint8_t> copy = fat;
+
+    double packedPack = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < count; i++) {
+                getPackedEntry(copy.data(), i).setValue(table.get(i));
+            }
+        }
+    });
+
+    double tablePack = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            // One entry per group is enough to have all of them packed
+            for (size_t i = 0; i < count; i += 16) {
+                table.set(i, table.get(i));
+            }
+
+            table.flush();
+        }
+    });
+
+    if (copy != fat || sum == 0) {
+        printf("FAT differs after packing\n");
+        throw -1;
+    }
+
+    printf("FAT of %zu entries\n", count);
+    reportEntries("  Walk chain, FatEntry", walked, packedWalk);
+    reportEntries("  Walk chain, FatTable", walked, tableWalk);
+    reportEntries("  Unpack, FatEntry", rounds * count, packedUnpack);
+    reportEntries("  Unpack, FatTable", rounds * count, tableUnpack);
+    reportEntries("  Pack, FatEntry", rounds * count, packedPack);
+    reportEntries("  Pack, FatTable", rounds * count, tablePack);
+}
+
+// Allocates the last free tenth of a FAT one cluster at a time, the way a
+// large write does
+static void benchAllocate() {
+    const size_t fatSize = 12 * 512;
+    const size_t count = fatSize * 8 / 12;
+    const size_t rounds = 200;
+
+    std::vector<uint8_t> fat(fatSize);
+    Region region = {fat.data(), 0, fatSize, 0};
+
+    for (size_t i = 0; i < count * 9 / 10; i++) {
+        getPackedEntry(fat.data(), i).setValue(0xFFF);
+    }
+
+    size_t toAllocate = count - count * 9 / 10;
+    size_t allocated = 0;
+
+    double scanned = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            FatTable table(region, fatSize, count);
+
+            for (size_t n = 0; n < toAllocate; n++) {
+                for (size_t i = 0; i < count; i++) {
+                    if (table.get(i) == 0) {
+                        table.set(i, 0xFFF);
+                        allocated++;
+                        break;
+                    }
+                }
+            }
+        }
+    });
+
+    double nextFit = measure([&] {
+        for (size_t r = 0; r < rounds; r++) {
+            FatTable table(region, fatSize, count);
+
+            for (size_t n = 0; n < toAllocate; n++) {
+                table.set(table.findFree(), 0xFFF);
+                allocated++;
+            }
+
+            if (table.freeCount() || table.findFree() != 0xFFF) {
+                printf("Free clusters left after allocating all\n");
+                throw -1;
+            }
+        }
+    });
+
+    if (allocated != 6 * rounds * toAllocate) {
+        printf("Allocated %zu clusters\n", allocated);
+        throw -1;
+    }
+
+    printf("Allocate %zu clusters\n", toAllocate);
+    reportEntries("  Scan from cluster 0", rounds * toAllocate, scanned);
+    reportEntries("  Next fit in free bitmap", rounds * toAllocate, nextFit);
+}
+
+int main(int argc, char *argv[]) {
+    size_t mib = 256;
+
+    if (argc > 1) {
+        mib = strtoul(argv[1], 0, 10);
+    }
+
+    if (!mib) {
+        printf("usage: %s [MiB of data to scan, default 256]\n", argv[0]);
+        return -1;
+    }
+
+    try {
+        std::vector<uint8_t> buffer(mib * 1024 * 1024);
+
+        benchScan("Scan zeroed image", buffer);
+
+        uint64_t state = 0x9E3779B97F4A7C15ull;
+
+        for (size_t i = 0; i + 8 <= buffer.size(); i += 8) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            memcpy(buffer.data() + i, &state, 8);
+        }
+
+        benchScan("Scan random image", buffer);
+        benchFat(state);
+        benchAllocate();
+    } catch (int ex) {
+        return ex;
+    }
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+// Moves the clusters of every file and directory on the FAT12 volumes of an
+// image next to each other
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "fat12.h"
+#include "file.h"
+#include "journal.h"
+
+struct Chain {
+    std::vector<uint16_t> clusters;
+
+    // System files (i.e. IO.SYS) are expected where they are by the boot
+    // loader and are never moved
+    bool fixed;
+};
+
+struct Layout {
+    std::vector<Chain> chains;
+
+    // Every entry pointing to a chain, including "." and ".."
+    std::vector<FileEntry *> entries;
+
+    // Clusters which are part of a chain
+    std::vector<bool> used;
+};
+
+static bool isDataCluster(uint16_t cluster, uint16_t maxCluster) {
+    return cluster >= 2 && cluster < maxCluster;
+}
+
+static Chain getChain(Fat12Volume &fat12Volume, Layout &layout,
+                      FileEntry *entry) {
+    Chain chain{{}, (entry->attr & ATTR_SYSTEM) != 0};
+
+    uint16_t cluster = entry->firstDataClusterLow;
+
+    while (cluster < 0xFF8) {
+        if (!isDataCluster(cluster, fat12Volume.maxCluster)) {
+            printf("Cluster %hu is out of range -- run hdifdisk first\n",
+                   cluster);
+            throw -1;
+        }
+
+        // Also catches loops
+        if (layout.used[cluster]) {
+            printf("Cluster %hu is used twice -- run hdifdisk first\n",
+                   cluster);
+            throw -1;
+        }
+
+        layout.used[cluster] = true;
+        chain.clusters.push_back(cluster);
+        cluster = fat12Volume.fat.get(cluster);
+    }
+
+    return chain;
+}
+
+static void collect(Fat12Volume &fat12Volume, Layout &layout,
+                    FileEntry *entries, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        FileEntry *entry = entries + i;
+
+        if (!entry->isValid() || entry->firstDataClusterLow == 0) {
+            continue;
+        }
+
+        if (entry->isDotOrDotDot()) {
+            // Not checked by getChain, as they point to chains collected
+            // elsewhere
+            if (!isDataCluster(entry->firstDataClusterLow,
+                               fat12Volume.maxCluster)) {
+                printf("\"%s\" points to cluster %hu, which is out of "
+                       "range\n",
+                       entry->filename[1] == '.' ? ".." : ".",
+                       (uint16_t)entry->firstDataClusterLow);
+                throw -1;
+            }
+
+            layout.entries.push_back(entry);
+            continue;
+        }
+
+        layout.entries.push_back(entry);
+
+        layout.chains.push_back(getChain(fat12Volume, layout, entry));
+
+        if (!entry->isDirectory()) {
+            continue;
+        }
+
+        // Copied, as collecting the children adds to the chains
+        std::vector<uint16_t> clusters = layout.chains.back().clusters;
+
+        for (uint16_t cluster : clusters) {
+            collect(fat12Volume, layout,
+                    (FileEntry *)(fat12Volume.dataRegion.ptr +
+                                  (cluster - 2) * fat12Volume.clusterSize),
+                    fat12Volume.clusterSize / sizeof(FileEntry));
+        }
+    }
+}
+
+// Runs of adjacent clusters over all chains, with the clusters mapped
+// through newCluster
+static size_t countFragments(const Layout &layout,
+                             const std::vector<uint16_t> &newCluster,
+                             size_t &fragmented) {
+    size_t fragments = 0;
+    fragmented = 0;
+
+    for (const Chain &chain : layout.chains) {
+        size_t runs = 1;
+
+        for (size_t i = 1; i < chain.clusters.size(); i++) {
+            if (newCluster[chain.clusters[i]] !=
+                newCluster[chain.clusters[i - 1]] + 1) {
+                runs++;
+            }
+        }
+
+        fragments += runs;
+
+        if (runs > 1) {
+            fragmented++;
+        }
+    }
+
+    return fragments;
+}
+
+static void printStats(const char *when, const Layout &layout,
+                       const std::vector<uint16_t> &newCluster) {
+    size_t fragmented;
+    size_t fragments = countFragments(layout, newCluster, fragmented);
+
+    printf("%s: %zu chains, %zu fragmented, %zu runs of clusters\n", when,
+           layout.chains.size(), fragmented, fragments);
+}
+
+// Returns whether anything was moved
+static bool defragment(Fat12Volume &fat12Volume, bool traversalOrder,
+                       bool dryRun) {
+    uint16_t maxCluster = fat12Volume.maxCluster;
+    FatTable &fat = fat12Volume.fat;
+
+    if (maxCluster <= 2) {
+        printf("No data clusters\n");
+        return false;
+    }
+
+    Layout layout;
+    layout.used.resize(maxCluster);
+
+    collect(fat12Volume, layout, (FileEntry *)fat12Volume.rootRegion.ptr,
+            fat12Volume.regionBPB.bootBlock.rootEntries);
+
+    // Clusters which stay where they are: those of system files, bad ones
+    // and those allocated without being part of any chain
+    std::vector<bool> fixed(maxCluster);
+    size_t orphans = 0;
+
+    for (uint16_t cluster = 2; cluster < maxCluster; cluster++) {
+        uint16_t value = fat.get(cluster);
+
+        if (value != 0 && !layout.used[cluster]) {
+            fixed[cluster] = true;
+
+            if (value != 0xFF7) {
+                orphans++;
+            }
+        }
+    }
+
+    if (orphans) {
+        printf("%zu clusters are not part of any chain and stay in place\n",
+               orphans);
+    }
+
+    std::vector<uint16_t> identity(maxCluster);
+
+    for (uint16_t cluster = 0; cluster < maxCluster; cluster++) {
+        identity[cluster] = cluster;
+    }
+
+    std::vector<uint16_t> newCluster(identity);
+
+    std::vector<Chain *> order;
+
+    for (Chain &chain : layout.chains) {
+        if (chain.fixed) {
+            for (uint16_t cluster : chain.clusters) {
+                fixed[cluster] = true;
+            }
+        } else {
+            order.push_back(&chain);
+        }
+    }
+
+    // Otherwise the chains keep their order on the volume, which moves
+    // fewer clusters
+    if (!traversalOrder) {
+        std::stable_sort(order.begin(), order.end(),
+                         [](const Chain *a, const Chain *b) {
+                             return a->clusters[0] < b->clusters[0];
+                         });
+    }
+
+    uint16_t next = 2;
+
+    for (Chain *chain : order) {
+        for (uint16_t cluster : chain->clusters) {
+            while (fixed[next]) {
+                next++;
+            }
+
+            newCluster[cluster] = next++;
+        }
+    }
+
+    printStats("Before", layout, identity);
+    printStats("After", layout, newCluster);
+
+    if (newCluster == identity) {
+        printf("Nothing to move\n");
+        return false;
+    }
+
+    if (dryRun) {
+        return false;
+    }
+
+    // The entries are changed where they are and then moved with the
+    // clusters of their directory
+    for (FileEntry *entry : layout.entries) {
+        entry->firstDataClusterLow = newCluster[entry->firstDataClusterLow];
+        fat12Volume.volume.markDirty(entry, sizeof(*entry));
+    }
+
+    size_t clusterSize = fat12Volume.clusterSize;
+    uint8_t *data = fat12Volume.dataRegion.ptr;
+    std::vector<uint8_t> previous(data, data + (maxCluster - 2) * clusterSize);
+    size_t moved = 0;
+
+    for (uint16_t cluster = 2; cluster < maxCluster; cluster++) {
+        if (newCluster[cluster] == cluster) {
+            continue;
+        }
+
+        uint8_t *ptr = data + (newCluster[cluster] - 2) * clusterSize;
+
+        memcpy(ptr, previous.data() + (cluster - 2) * clusterSize,
+               clusterSize);
+        fat12Volume.dataRegion.markDirty(ptr, clusterSize);
+        moved++;
+    }
+
+    std::vector<uint16_t> values(maxCluster);
+
+    for (uint16_t cluster = 2; cluster < maxCluster; cluster++) {
+        if (fixed[cluster]) {
+            values[cluster] = fat.get(cluster);
+        }
+    }
+
+    for (const Chain *chain : order) {
+        const std::vector<uint16_t> &clusters = chain->clusters;
+
+        for (size_t i = 0; i + 1 < clusters.size(); i++) {
+            values[newCluster[clusters[i]]] = newCluster[clusters[i + 1]];
+        }
+
+        values[newCluster[clusters.back()]] = fat.get(clusters.back());
+    }
+
+    for (uint16_t cluster = 2; cluster < maxCluster; cluster++) {
+        if (fat.get(cluster) != values[cluster]) {
+            fat.set(cluster, values[cluster]);
+        }
+    }
+
+    fat.flush();
+
+    printf("Moved %zu clusters\n", moved);
+
+    return true;
+}
+
+static void printusage(const char *progname) {
+    printf("Use \"%s [-n] [-t] [-j] <hdifile>\" to move the clusters of each "
+           "file and directory on the FAT12 volumes of the image next to "
+           "each other\n",
+           progname);
+    printf("Use -n to only print how fragmented the volumes are\n");
+    printf("Use -t to lay out the files in the order of the directory tree "
+           "instead of keeping their order on the volume\n");
+    printf("Use -j to write the changes in place through a journal instead of "
+           "replacing the image with a shadow copy\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool dryRun = false;
+    bool traversalOrder = false;
+    bool journaled = false;
+
+    if (argc < 2) {
+        printusage(argv[0]);
+        return -1;
+    }
+
+    for (int i = 1; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            dryRun = true;
+        } else if (strcmp(argv[i], "-t") == 0) {
+            traversalOrder = true;
+        } else if (strcmp(argv[i], "-j") == 0) {
+            journaled = true;
+        } else {
+            printf("Unknown option %s\n", argv[i]);
+            printusage(argv[0]);
+            return -1;
+        }
+    }
+
+    std::string filename(argv[argc - 1]);
+
+    try {
+        // A dry run never writes the image, the journal may also belong to
+        // a writer still updating it
+        if (!dryRun) {
+            replayJournal(filename);
+        } else if (journalExists(filename)) {
+            printf("Journal %s present -- showing the image as it is\n",
+                   getJournalFilename(filename).c_str());
+        }
+
+        FileDescriptorRO fd(filename.c_str());
+        MemoryMap image(fd.fd, dryRun ? MAP_READ_ONLY : MAP_COPY_ON_WRITE);
+        DirtyMap dirty(image.data, image.size);
+
+        std::vector<Fat12Volume> fat12Volumes(
+            getFatVolumes(image.data, image.size, &dirty));
+
+        bool changed = false;
+
+        for (Fat12Volume &fat12Volume : fat12Volumes) {
+            printf("Volume at 0x%zX\n",
+                   (size_t)(fat12Volume.volume.buffer - image.data));
+
+            if (defragment(fat12Volume, traversalOrder, dryRun)) {
+                changed = true;
+            }
+        }
+
+        if (!changed) {
+            return 0;
+        }
+
+        bool ret =
+            journaled
+                ? writeBackJournaled(filename, image.data, image.size, dirty)
+                : writeBackImage(filename, image.data, image.size, dirty);
+
+        if (!ret) {
+            return -2;
+        }
+
+        printf("Written data to image\n");
+
+    } catch (int ex) {
+        return ex;
+    }
+
+    return 0;
+}
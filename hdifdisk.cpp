@@ -9,95 +9,91 @@
 #include <string>
 #include <vector>
 
+#include "codepage.h"
 #include "fat12.h"
 #include "file.h"
+#include "journal.h"
 #include "util.h"
 
-static FatEntry getFatEntry(Region &regionFat, uint16_t i) {
-    uint32_t idx = ((uint32_t)i * 12) / 8;
-    bool odd = (i % 2);
+// Owner of every cluster, found by walking the directory tree once. Chains
+// are numbered from 1 in the order they are reached, 0 is no owner
+struct ClusterOwners {
+    FatTable &fat;
+    Region &dataRegion;
+    size_t clusterSize;
+    uint16_t maxCluster;
 
-    return {regionFat.ptr + idx, odd};
+    std::vector<uint32_t> owner;
+    std::vector<std::string> paths;
 };
 
-static bool checkChain(Region &fatRegion, FileEntry *file,
-                       uint16_t clusterToBeFound) {
-    uint16_t clusterNumber = file->firstDataClusterLow;
+// Returns the clusters which were not already owned by another chain
+static std::vector<uint16_t> claimChain(ClusterOwners &owners, FileEntry *file,
+                                        const std::string &path) {
+    std::vector<uint16_t> clusters;
 
-    if (clusterNumber == 0) {
-        // File empty
-        return false;
-    }
-
-    if (clusterNumber == clusterToBeFound)
-        return true;
-
-    while (clusterNumber != 0xFFF) {
-        clusterNumber = getFatEntry(fatRegion, clusterNumber).getValue();
-        if (clusterNumber == clusterToBeFound)
-            return true;
-    }
-
-    return false;
-}
-
-static bool entryPresentDirectoryRecursive(Region &fatRegion,
-                                           Region &dataRegion, FileEntry *file,
-                                           size_t clusterSize,
-                                           uint16_t clusterToBeFound) {
-    uint16_t clusterNumber = file->firstDataClusterLow;
-
-    while (clusterNumber != 0xFFF) {
-        // The directory was already checked on the call before
+    owners.paths.push_back(path);
+    uint32_t chain = owners.paths.size();
 
-        uint8_t *curBuffer =
-            dataRegion.ptr + ((clusterNumber - 2) * clusterSize);
-        size_t entries = clusterSize / 32;
+    uint16_t cluster = file->firstDataClusterLow;
 
-        for (uint16_t i = 0; i < entries; i++) {
-            FileEntry *entry = (FileEntry *)(curBuffer + i * 32);
+    while (cluster < 0xFF8) {
+        if (cluster < 2 || cluster >= owners.maxCluster) {
+            printf("%s points to cluster %hu, which is out of range\n",
+                   path.c_str(), cluster);
+            break;
+        }
 
-            if (entry->isValid()) {
-                if (checkChain(fatRegion, entry, clusterToBeFound))
-                    return true;
-            }
+        uint32_t previous = owners.owner[cluster];
 
-            if (entry->isValid() && entry->isDirectory() &&
-                !entry->isDotOrDotDot()) {
+        if (previous == chain) {
+            printf("%s loops back to cluster %hu\n", path.c_str(), cluster);
+            break;
+        }
 
-                if (entryPresentDirectoryRecursive(fatRegion, dataRegion, entry,
-                                                   clusterSize,
-                                                   clusterToBeFound)) {
-                    return true;
-                }
-            }
+        // The rest of the chain is shared as well
+        if (previous) {
+            printf("Cluster %hu is used by both %s and %s\n", cluster,
+                   owners.paths[previous - 1].c_str(), path.c_str());
+            break;
         }
 
-        clusterNumber = getFatEntry(fatRegion, clusterNumber).getValue();
+        owners.owner[cluster] = chain;
+        clusters.push_back(cluster);
+        cluster = owners.fat.get(cluster);
     }
 
-    return false;
+    return clusters;
 }
 
-static bool entryPresentRootDirectoryRecursive(
-    Region &fatRegion, Region &dataRegion, uint8_t *buffer, uint16_t entries,
-    size_t clusterSize, uint16_t clusterToBeFound) {
-    for (uint16_t i = 0; i < entries; i++) {
+static void claimDirectory(ClusterOwners &owners, uint8_t *buffer,
+                           size_t entries, const std::string &path) {
+    for (size_t i = 0; i < entries; i++) {
         FileEntry *entry = (FileEntry *)(buffer + i * 32);
 
-        if (entry->isValid()) {
-            if (checkChain(fatRegion, entry, clusterToBeFound))
-                return true;
+        // "." and ".." point to chains owned by other entries
+        if (!entry->isValid() || entry->isDotOrDotDot() ||
+            entry->firstDataClusterLow == 0) {
+            continue;
         }
 
-        if (entry->isValid() && entry->isDirectory()) {
-            if (entryPresentDirectoryRecursive(fatRegion, dataRegion, entry,
-                                               clusterSize, clusterToBeFound))
-                return true;
+        std::string entryPath =
+            path + "/" + getCanonicalString(entry->filename);
+        std::vector<uint16_t> clusters = claimChain(owners, entry, entryPath);
+
+        if (!entry->isDirectory()) {
+            continue;
         }
-    }
 
-    return false;
+        // Only the clusters claimed here, so that directories referring to
+        // each other are not walked forever
+        for (uint16_t cluster : clusters) {
+            claimDirectory(owners,
+                           owners.dataRegion.ptr +
+                               (cluster - 2) * owners.clusterSize,
+                           owners.clusterSize / 32, entryPath);
+        }
+    }
 }
 
 static void printusage(const char *progname) {
@@ -112,6 +108,8 @@ static void printusage(const char *progname) {
            "Use in combination with -s\n");
     printf("Use -s <value> in decimal to set which value the modified inodes "
            "should be set to\n");
+    printf("Use -j to write modifications in place through a journal instead "
+           "of replacing the image with a shadow copy\n");
 }
 
 // TODO: Change to sw1tch
@@ -192,28 +190,20 @@ static ArgArray getArgs(int argc, char *argv[]) {
 }
 
 static void writeFile(Fat12Volume &fat12Volume, const std::string &filename,
-                      std::vector<uint8_t> &filedata) {
+                      MemoryMap &image, DirtyMap &dirty, bool journaled) {
     printf("Sync fat\n");
-    syncFAT(fat12Volume.regionBPB.bootBlock, fat12Volume.volume);
-
-    std::string shadowFilename = filename + ".shadow";
-    printf("Write shadow file %s\n", shadowFilename.c_str());
-
-    bool ret = false;
+    fat12Volume.fat.flush();
 
-    {
-        FileDescriptorWO fdwo(shadowFilename.c_str());
-        ret = pumpBuffer(filedata, fdwo.fd);
-    }
+    bool ret =
+        journaled
+            ? writeBackJournaled(filename, image.data, image.size, dirty)
+            : writeBackImage(filename, image.data, image.size, dirty);
 
-    if (ret) {
-        // todo: eval ret
-        rename(shadowFilename.c_str(), filename.c_str());
-        printf("Written data to image\n");
-    } else {
-        printf("Could not write shadow file\n");
+    if (!ret) {
         throw -2;
     }
+
+    printf("Written data to image\n");
 }
 
 int main(int argc, char *argv[]) {
@@ -221,14 +211,29 @@ int main(int argc, char *argv[]) {
     try {
         ArgArray args(getArgs(argc, argv));
 
+        // Only a run which modifies the image replays the journal, which
+        // may also belong to a writer still updating the image
+        if (args.has("-m")) {
+            replayJournal(args.filename);
+        } else if (journalExists(args.filename)) {
+            printf("Journal %s present -- showing the image as it is\n",
+                   getJournalFilename(args.filename).c_str());
+        }
+
         FileDescriptorRO fd(args.filename.c_str());
 
-        auto filedata = getBuffer(fd.fd);
+        // Only -m modifies the volume, everything else just reads the pages
+        // it needs from the shared page cache
+        MemoryMap image(fd.fd,
+                        args.has("-m") ? MAP_COPY_ON_WRITE : MAP_READ_ONLY);
 
-        printf("Process buffer %zu\n", filedata.size());
+        DirtyMap dirty(image.data, image.size);
+
+        printf("Process buffer %zu\n", image.size);
 
         {
-            Fat12Volume fat12Volume(getFatVolume(filedata));
+            Fat12Volume fat12Volume(
+                getFatVolume(image.data, image.size, &dirty));
 
             if (args.has("-m")) {
                 if (!args.has("-s")) {
@@ -266,15 +271,15 @@ int main(int argc, char *argv[]) {
                         throw -8;
                     }
 
-                    getFatEntry(fat12Volume.fatRegion, clusterToBeSet)
-                        .setValue(clusterValue);
+                    fat12Volume.fat.set(clusterToBeSet, clusterValue);
                 }
 
-                writeFile(fat12Volume, args.filename, filedata);
+                writeFile(fat12Volume, args.filename, image, dirty,
+                          args.has("-j"));
             }
 
             printRootDirectoryRecursive(
-                fat12Volume.fatRegion, fat12Volume.dataRegion,
+                fat12Volume.fat, fat12Volume.dataRegion,
                 fat12Volume.rootRegion.ptr,
                 fat12Volume.regionBPB.bootBlock.rootEntries,
                 fat12Volume.clusterSize);
@@ -282,42 +287,41 @@ int main(int argc, char *argv[]) {
             {
                 uint16_t expectedFat0Entry =
                     0xF00 + fat12Volume.regionBPB.bootBlock.mediaType;
-                if (getFatEntry(fat12Volume.fatRegion, 0).getValue() !=
-                    expectedFat0Entry) {
+                if (fat12Volume.fat.get(0) != expectedFat0Entry) {
 
                     printf("First entry in fat is not 0x%hX, 0x%hX instead\n",
-                           expectedFat0Entry,
-                           getFatEntry(fat12Volume.fatRegion, 0).getValue());
+                           expectedFat0Entry, fat12Volume.fat.get(0));
                     printf("First 16 bytes (Fat 0)\n");
                     hexdump(fat12Volume.fatRegion.ptr, 16);
                 }
             }
 
-            if (getFatEntry(fat12Volume.fatRegion, 1).getValue() != 0xFFF) {
+            if (fat12Volume.fat.get(1) != 0xFFF) {
                 printf("Second entry in fat is not 0xFFF, 0x%hX instead\n",
-                       getFatEntry(fat12Volume.fatRegion, 0).getValue());
+                       fat12Volume.fat.get(0));
                 printf("First 16 bytes (Fat 0)\n");
                 hexdump(fat12Volume.fatRegion.ptr, 16);
             }
 
-            // Check for orphans
+            // Check for cross-linked clusters, loops and orphans
             {
+                ClusterOwners owners{fat12Volume.fat,
+                                     fat12Volume.dataRegion,
+                                     fat12Volume.clusterSize,
+                                     fat12Volume.maxCluster,
+                                     std::vector<uint32_t>(
+                                         fat12Volume.maxCluster),
+                                     {}};
+
+                claimDirectory(owners, fat12Volume.rootRegion.ptr,
+                               fat12Volume.regionBPB.bootBlock.rootEntries,
+                               "");
+
                 std::vector<uint16_t> orphans;
 
                 for (size_t i = 2; i < fat12Volume.maxCluster; i++) {
-                    FatEntry entry = getFatEntry(fat12Volume.fatRegion, i);
-                    uint16_t cluster = entry.getValue();
-
-                    // printf("Fat Entry %zu, value %hu\n", i, cluster);
-
-                    if (cluster != 0) {
-                        if (!entryPresentRootDirectoryRecursive(
-                                fat12Volume.fatRegion, fat12Volume.dataRegion,
-                                fat12Volume.rootRegion.ptr,
-                                fat12Volume.regionBPB.bootBlock.rootEntries,
-                                fat12Volume.clusterSize, i)) {
-                            orphans.push_back(i);
-                        }
+                    if (fat12Volume.fat.get(i) != 0 && !owners.owner[i]) {
+                        orphans.push_back(i);
                     }
                 }
 
@@ -337,9 +341,8 @@ int main(int argc, char *argv[]) {
 
                 if (arg.params.empty()) {
                     for (size_t i = 0; i < fat12Volume.maxCluster; i++) {
-                        printf(
-                            "Fat Entry %zu, value %hu\n", i,
-                            getFatEntry(fat12Volume.fatRegion, i).getValue());
+                        printf("Fat Entry %zu, value %hu\n", i,
+                               fat12Volume.fat.get(i));
                     }
                 } else {
                     for (const auto &param : arg.params) {
@@ -347,8 +350,7 @@ int main(int argc, char *argv[]) {
 
                         if (cluster < fat12Volume.maxCluster) {
                             printf("Fat Entry %hu, value %hu\n", cluster,
-                                   getFatEntry(fat12Volume.fatRegion, cluster)
-                                       .getValue());
+                                   fat12Volume.fat.get(cluster));
                         } else {
                             printf("Fat Entry %hu is out of range\n", cluster);
                         }
@@ -356,19 +358,9 @@ int main(int argc, char *argv[]) {
                 }
             }
 
-            // TODO: Catch multiple usages of clusters
-            // TODO: Catch cluster loops
-
-            uint16_t freeCount = 0;
-
-            for (size_t i = 2; i < fat12Volume.maxCluster; i++) {
-                FatEntry entry = getFatEntry(fat12Volume.fatRegion, i);
-                if (entry.getValue() == 0) {
-                    freeCount++;
-                }
-            }
+            size_t freeCount = fat12Volume.fat.freeCount();
 
-            printf("%hu clusters free, equal to %zu bytes\n", freeCount,
+            printf("%zu clusters free, equal to %zu bytes\n", freeCount,
                    freeCount * fat12Volume.clusterSize);
         }
 
@@ -13,170 +13,348 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "codepage.h"
 #include "fat12.h"
 #include "file.h"
+#include "image.h"
+#include "journal.h"
 #include "util.h"
 
 #include <algorithm>
+#include <deque>
 #include <memory>
 #include <string>
+#include <unordered_map>
 
-static FatEntry getFatEntry(Region &regionFat, uint16_t i) {
-    uint32_t idx = ((uint32_t)i * 12) / 8;
-    bool odd = (i % 2);
+// Directory clusters are pinned, as FileEntry pointers into them are kept
+static uint8_t *getCluster(Region &dataRegion, size_t clusterSize,
+                           uint16_t cluster, bool pin = false) {
+    uint8_t *ptr = dataRegion.ptr + ((cluster - 2) * clusterSize);
 
-    return {regionFat.ptr + idx, odd};
-};
+    if (dataRegion.cache) {
+        dataRegion.cache->load(ptr, clusterSize, pin);
+    }
+
+    return ptr;
+}
+
+// Names are compared the way strcasecmp does, ignoring the case of ASCII
+// letters only
+static std::string getNameKey(const std::string &name) {
+    std::string key(name);
+
+    for (char &c : key) {
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+    }
+
+    return key;
+}
 
 class Fat12Inode {
   public:
     FileEntry *file;
-    std::vector<Fat12Inode> children;
     uint32_t inode;
+
+    // Children are linked through their siblings, in the order they were
+    // added. The root has no parent
+    Fat12Inode *parent;
+    Fat12Inode *firstChild = 0;
+    Fat12Inode *lastChild = 0;
+    Fat12Inode *prevSibling = 0;
+    Fat12Inode *nextSibling = 0;
+
+    // Children by their nameKey. Several entries may end up with the same
+    // key, i.e. once the first one was deleted
+    std::unordered_multimap<std::string, Fat12Inode *> names;
+
+    // The name of the entry in UTF-8 and its getNameKey, from when the
+    // inode was added. The entry itself is already marked as deleted when
+    // the inode is removed
+    std::string name;
+    std::string nameKey;
+
     uint64_t nlookup;
     bool zombie = false;
 
-    bool operator==(const Fat12Inode &ref) { return ref.inode == inode; }
+    // Directories are only scanned for their children once these are
+    // needed, see InodeTable::load
+    bool scanned = false;
+
+    // The volume the entry is stored in. Not set for the directory holding
+    // the volumes if there are several
+    Fat12Volume *volume;
 
-    Fat12Inode(Fat12Volume &fat12Volume, FileEntry *file_,
-               uint32_t &inodeCounter)
-        : file(file_), inode(inodeCounter), nlookup(0) {
-        inodeCounter++;
+    // Children are stored in the root region of the volume instead of in
+    // clusters
+    bool volumeRoot;
 
-        if (file->isDirectory() && !file->isDotOrDotDot()) {
+    Fat12Inode(FileEntry *file_, uint32_t inode_, Fat12Inode *parent_,
+               Fat12Volume *volume_, bool volumeRoot_)
+        : file(file_), inode(inode_), parent(parent_), nlookup(0),
+          volume(volume_), volumeRoot(volumeRoot_) {}
+
+    FileEntry *getFreeFileEntry() {
+        assert(file->isDirectory() && volume);
+
+        Fat12Volume &fat12Volume = *volume;
+
+        if (volumeRoot) {
+            // Root, use root region
+
+            for (FileEntry *entry = (FileEntry *)fat12Volume.rootRegion.ptr;
+                 entry < ((FileEntry *)fat12Volume.rootRegion.ptr) +
+                             fat12Volume.regionBPB.bootBlock.rootEntries;
+                 entry++) {
+
+                if (!entry->isValid()) {
+                    return entry;
+                }
+            }
+        } else {
 
             uint16_t clusterNumber = file->firstDataClusterLow;
 
             while (clusterNumber != 0xFFF) {
 
                 uint8_t *curBuffer =
-                    fat12Volume.dataRegion.ptr +
-                    ((clusterNumber - 2) * fat12Volume.clusterSize);
+                    getCluster(fat12Volume.dataRegion, fat12Volume.clusterSize,
+                               clusterNumber, true);
 
                 size_t entries = fat12Volume.clusterSize / 32;
 
                 for (uint16_t i = 0; i < entries; i++) {
                     FileEntry *entry = (FileEntry *)(curBuffer + i * 32);
 
-                    if (entry->isValid() && !file->isDotOrDotDot()) {
-                        children.push_back({fat12Volume, entry, inodeCounter});
+                    if (!entry->isValid()) {
+                        return entry;
                     }
                 }
 
-                clusterNumber =
-                    getFatEntry(fat12Volume.fatRegion, clusterNumber)
-                        .getValue();
+                clusterNumber = fat12Volume.fat.get(clusterNumber);
             }
         }
+
+        return 0;
     }
+};
 
-    Fat12Inode(Fat12Volume &fat12Volume, FileEntry *file_, uint16_t entries,
-               uint8_t *ptr, uint32_t &inodeCounter)
-        : file(file_), inode(inodeCounter) {
-        inodeCounter++;
+// All inodes by their number. The nodes are taken from blocks which are
+// never moved, nodes of removed inodes are reused for new ones
+class InodeTable {
+    std::deque<Fat12Inode> nodes;
+    std::vector<Fat12Inode *> freeNodes;
+
+    // Indexed by inode number, starting at FUSE_ROOT_ID. Numbers are not
+    // reused, removed ones are 0
+    std::vector<Fat12Inode *> index;
+
+    Fat12Inode &allocate(FileEntry *file, Fat12Inode *parent,
+                         Fat12Volume *volume, bool volumeRoot) {
+        Fat12Inode node(file, FUSE_ROOT_ID + index.size(), parent, volume,
+                        volumeRoot);
+        Fat12Inode *ptr;
+
+        if (freeNodes.empty()) {
+            nodes.push_back(node);
+            ptr = &nodes.back();
+        } else {
+            ptr = freeNodes.back();
+            freeNodes.pop_back();
+            *ptr = node;
+        }
 
-        for (uint16_t i = 0; i < entries; i++) {
-            FileEntry *entry = (FileEntry *)(ptr + i * 32);
+        index.push_back(ptr);
 
-            if (entry->isValid()) {
-                children.push_back({fat12Volume, entry, inodeCounter});
+        ptr->name = getCanonicalString(file->filename);
+        ptr->nameKey = getNameKey(ptr->name);
+
+        if (parent) {
+            ptr->prevSibling = parent->lastChild;
+
+            if (parent->lastChild) {
+                parent->lastChild->nextSibling = ptr;
+            } else {
+                parent->firstChild = ptr;
             }
+
+            parent->lastChild = ptr;
+
+            parent->names.emplace(ptr->nameKey, ptr);
         }
+
+        return *ptr;
     }
 
-    FileEntry *find(uint32_t inode_) {
-        if (inode_ == inode) {
-            return file;
-        }
+    void scan(Fat12Inode &dir) {
+        Fat12Volume &fat12Volume = *dir.volume;
 
-        for (auto &child : children) {
-            FileEntry *entry = child.find(inode_);
-            if (entry) {
-                return entry;
+        if (dir.volumeRoot) {
+            uint8_t *ptr = fat12Volume.rootRegion.ptr;
+
+            for (uint16_t i = 0;
+                 i < fat12Volume.regionBPB.bootBlock.rootEntries; i++) {
+                FileEntry *entry = (FileEntry *)(ptr + i * 32);
+
+                if (entry->isValid()) {
+                    add(&dir, entry);
+                }
             }
+
+            return;
         }
 
-        return 0;
+        uint16_t clusterNumber = dir.file->firstDataClusterLow;
+
+        while (clusterNumber != 0xFFF) {
+
+            uint8_t *curBuffer =
+                getCluster(fat12Volume.dataRegion, fat12Volume.clusterSize,
+                           clusterNumber, true);
+
+            size_t entries = fat12Volume.clusterSize / 32;
+
+            for (uint16_t i = 0; i < entries; i++) {
+                FileEntry *entry = (FileEntry *)(curBuffer + i * 32);
+
+                if (entry->isValid()) {
+                    add(&dir, entry);
+                }
+            }
+
+            clusterNumber = fat12Volume.fat.get(clusterNumber);
+        }
     }
 
-    Fat12Inode *findParent(uint32_t inode_) {
-        for (auto &child : children) {
-            if (child.inode == inode_)
-                return this;
+    void release(Fat12Inode &node) {
+        for (Fat12Inode *child = node.firstChild; child;
+             child = child->nextSibling) {
+            release(*child);
         }
 
-        for (auto &child : children) {
-            Fat12Inode *result = child.findParent(inode_);
-            if (result)
-                return result;
+        index[node.inode - FUSE_ROOT_ID] = 0;
+        node.names.clear();
+        freeNodes.push_back(&node);
+    }
+
+  public:
+    Fat12Inode *find(uint32_t inode) {
+        if (inode < FUSE_ROOT_ID || inode - FUSE_ROOT_ID >= index.size()) {
+            return 0;
         }
 
-        return 0;
+        return index[inode - FUSE_ROOT_ID];
     }
 
-    Fat12Inode *findInode(uint32_t inode_) {
-        if (inode_ == inode) {
-            return this;
+    Fat12Inode *findParent(uint32_t inode) {
+        Fat12Inode *child = find(inode);
+
+        return child ? child->parent : 0;
+    }
+
+    // Adds the children of dir if it was not scanned yet. Needs to be done
+    // before they are accessed and before an entry is added to dir
+    void load(Fat12Inode &dir) {
+        if (dir.scanned) {
+            return;
+        }
+
+        dir.scanned = true;
+
+        // "." and ".." are left empty, as they were reached before
+        if (dir.volume && dir.file->isDirectory() &&
+            !dir.file->isDotOrDotDot()) {
+            scan(dir);
         }
+    }
+
+    // The first child of dir with the name which is not deleted. Unless
+    // exact is set, the case of ASCII letters is ignored
+    Fat12Inode *findChild(Fat12Inode &dir, const char *name,
+                          bool exact = false) {
+        load(dir);
 
-        for (auto &child : children) {
-            Fat12Inode *result = child.findInode(inode_);
-            if (result) {
-                return result;
+        auto range = dir.names.equal_range(getNameKey(name));
+        Fat12Inode *found = 0;
+
+        for (auto it = range.first; it != range.second; ++it) {
+            Fat12Inode *child = it->second;
+
+            // Children are numbered in the order they were added
+            if (child->zombie || (found && found->inode < child->inode)) {
+                continue;
             }
+
+            if (exact && child->name != name) {
+                continue;
+            }
+
+            found = child;
         }
 
-        return 0;
+        return found;
     }
 
-    FileEntry *getFreeFileEntry(Fat12Volume &fat12Volume) {
-        assert(file->isDirectory());
+    // Directory holding the root directories of several volumes
+    Fat12Inode &addRoot(FileEntry *file) {
+        return allocate(file, 0, 0, false);
+    }
 
-        if (inode == FUSE_ROOT_ID) {
-            // Root, use root region
+    // Root directory of a volume, either the root of the mount or below the
+    // one added with addRoot
+    Fat12Inode &addVolumeRoot(Fat12Inode *parent, Fat12Volume &fat12Volume,
+                              FileEntry *file) {
+        Fat12Inode &node = allocate(file, parent, &fat12Volume, true);
+        load(node);
 
-            for (FileEntry *entry = (FileEntry *)fat12Volume.rootRegion.ptr;
-                 entry < ((FileEntry *)fat12Volume.rootRegion.ptr) +
-                             fat12Volume.regionBPB.bootBlock.rootEntries;
-                 entry++) {
+        return node;
+    }
 
-                if (!entry->isValid()) {
-                    return entry;
-                }
-            }
-        } else {
+    Fat12Inode &add(Fat12Inode *parent, FileEntry *file) {
+        return allocate(file, parent, parent->volume, false);
+    }
 
-            uint16_t clusterNumber = file->firstDataClusterLow;
+    // Removes the inode along with everything below it
+    void remove(uint32_t inode) {
+        Fat12Inode *node = find(inode);
 
-            while (clusterNumber != 0xFFF) {
+        if (!node) {
+            return;
+        }
 
-                uint8_t *curBuffer =
-                    fat12Volume.dataRegion.ptr +
-                    ((clusterNumber - 2) * fat12Volume.clusterSize);
+        if (node->prevSibling) {
+            node->prevSibling->nextSibling = node->nextSibling;
+        } else if (node->parent) {
+            node->parent->firstChild = node->nextSibling;
+        }
 
-                size_t entries = fat12Volume.clusterSize / 32;
+        if (node->nextSibling) {
+            node->nextSibling->prevSibling = node->prevSibling;
+        } else if (node->parent) {
+            node->parent->lastChild = node->prevSibling;
+        }
 
-                for (uint16_t i = 0; i < entries; i++) {
-                    FileEntry *entry = (FileEntry *)(curBuffer + i * 32);
+        if (node->parent) {
+            auto &names = node->parent->names;
+            auto range = names.equal_range(node->nameKey);
 
-                    if (!entry->isValid()) {
-                        return entry;
-                    }
+            for (auto it = range.first; it != range.second; ++it) {
+                if (it->second == node) {
+                    names.erase(it);
+                    break;
                 }
-
-                clusterNumber =
-                    getFatEntry(fat12Volume.fatRegion, clusterNumber)
-                        .getValue();
             }
         }
 
-        return 0;
+        release(*node);
     }
 };
 
@@ -221,40 +399,235 @@ struct ClusterPos {
     uint32_t clusterOffset;
 };
 
-static ClusterPos seek(Region &fatRegion, uint16_t cluster, size_t clusterSize,
-                       size_t offset) {
+using MemoryHdl = std::unique_ptr<Memory>;
+
+static bool isDataCluster(uint16_t cluster) {
+    return cluster >= 2 && cluster < 0xFF7;
+}
+
+// Adjacent clusters of a chain, starting at the index fileCluster within it
+struct ClusterExtent {
+    size_t fileCluster;
+    uint16_t cluster;
+    size_t count;
+};
+
+// The chain of a file as runs of adjacent clusters, so that an offset is
+// found with a binary search instead of walking the chain. The runs are
+// built again on the first use after the FAT changed
+class ExtentMap {
+  public:
+    void update(FatTable &fat, uint16_t firstCluster_) {
+        if (built && generation == fat.generation() &&
+            firstCluster == firstCluster_) {
+            return;
+        }
+
+        extents.clear();
+        firstCluster = firstCluster_;
+        generation = fat.generation();
+        built = true;
+
+        // A chain cannot be longer than the FAT, unless it has a loop
+        size_t index = 0;
+
+        for (uint16_t cluster = firstCluster;
+             isDataCluster(cluster) && index < fat.size();
+             cluster = fat.get(cluster)) {
+            if (!extents.empty() &&
+                extents.back().cluster + extents.back().count == cluster) {
+                extents.back().count++;
+            } else {
+                extents.push_back({index, cluster, 1});
+            }
+
+            index++;
+        }
+    }
+
+    // The cluster at index fileCluster of the chain and the number of
+    // clusters adjacent to it from there on, itself included. False, with
+    // nothing set, if the chain is shorter
+    bool locate(size_t fileCluster, uint16_t &cluster, size_t &count) const {
+        auto it = std::upper_bound(extents.begin(), extents.end(), fileCluster,
+                                   [](size_t index, const ClusterExtent &e) {
+                                       return index < e.fileCluster;
+                                   });
+
+        if (it == extents.begin()) {
+            return false;
+        }
+
+        --it;
+
+        size_t skip = fileCluster - it->fileCluster;
+
+        if (skip >= it->count) {
+            return false;
+        }
+
+        cluster = it->cluster + skip;
+        count = it->count - skip;
+
+        return true;
+    }
+
+    // The last cluster of the chain and the length of it. False for files
+    // without clusters
+    bool last(uint16_t &cluster, size_t &length) const {
+        if (extents.empty()) {
+            return false;
+        }
+
+        cluster = extents.back().cluster + extents.back().count - 1;
+        length = extents.back().fileCluster + extents.back().count;
+
+        return true;
+    }
+
+  private:
+    std::vector<ClusterExtent> extents;
+    uint16_t firstCluster = 0;
+    uint64_t generation = 0;
+    bool built = false;
+};
+
+// How a file handle finds the clusters of its file. Sequential requests
+// continue from the cluster the last one ended in and appends go straight
+// to the end of the chain, neither needs a lookup. Both positions stay
+// valid as long as no chain is cut (see cutGeneration). Everything else is
+// looked up in the extent map
+class FileChain {
+  public:
+    // The cluster at index fileCluster of the file and the one before it.
+    // cluster is 0xFFF past the end of the chain. previous may be left 0 if
+    // cluster exists, as it is only needed to append to the chain. False if
+    // the chain does not even reach the one before
+    bool locate(FatTable &fat, FileEntry *file, size_t fileCluster,
+                uint16_t &cluster, uint16_t &previous) {
+        sync(fat, file);
+
+        if (hasCursor && fileCluster == lastFileCluster) {
+            cluster = lastCluster;
+            previous = 0;
+            return true;
+        }
+
+        if (hasCursor && fileCluster == lastFileCluster + 1) {
+            cluster = fat.get(lastCluster);
+            previous = lastCluster;
+            return true;
+        }
+
+        // Unless someone else appended to the file in the meantime
+        if (hasTail && fat.get(tail) >= 0xFF8) {
+            if (fileCluster == length) {
+                cluster = 0xFFF;
+                previous = tail;
+                return true;
+            }
+
+            if (fileCluster + 1 == length) {
+                cluster = tail;
+                previous = 0;
+                return true;
+            }
+        }
+
+        extents.update(fat, firstCluster);
+        hasTail = extents.last(tail, length);
+
+        size_t run;
+        cluster = 0xFFF;
+        previous = 0;
+
+        if (fileCluster && !extents.locate(fileCluster - 1, previous, run)) {
+            return false;
+        }
 
-    unsigned int skipCluster = offset / clusterSize;
-    unsigned int skippedCluster = 0;
+        extents.locate(fileCluster, cluster, run);
 
-    for (unsigned int i = 0; i < skipCluster && cluster != 0xFFF; i++) {
-        cluster = getFatEntry(fatRegion, cluster).getValue();
-        skippedCluster++;
+        return true;
     }
 
-    return {cluster, skippedCluster * clusterSize,
-            (uint32_t)offset % (uint32_t)clusterSize};
-}
+    // The last cluster a request got to, after all its changes to the FAT
+    void reached(FatTable &fat, FileEntry *file, size_t fileCluster,
+                 uint16_t cluster) {
+        sync(fat, file);
 
-using MemoryHdl = std::unique_ptr<Memory>;
+        hasCursor = true;
+        lastFileCluster = fileCluster;
+        lastCluster = cluster;
+
+        if (fat.get(cluster) >= 0xFF8) {
+            hasTail = true;
+            tail = cluster;
+            length = fileCluster + 1;
+        }
+    }
+
+  private:
+    ExtentMap extents;
+    uint16_t firstCluster = 0;
+    uint64_t cuts = 0;
+
+    bool hasCursor = false;
+    size_t lastFileCluster = 0;
+    uint16_t lastCluster = 0;
 
-static size_t readCluster(Region &dataRegion, size_t clusterSize,
-                          ClusterPos &pos, size_t readCount,
-                          MemoryHdl &memory) {
+    bool hasTail = false;
+    size_t length = 0;
+    uint16_t tail = 0;
 
-    uint8_t *ptr =
-        dataRegion.ptr + ((pos.cluster - 2) * clusterSize) + pos.clusterOffset;
+    void sync(FatTable &fat, FileEntry *file) {
+        if (firstCluster != file->firstDataClusterLow ||
+            cuts != fat.cutGeneration()) {
+            firstCluster = file->firstDataClusterLow;
+            cuts = fat.cutGeneration();
+            hasCursor = false;
+            hasTail = false;
+        }
+    }
+};
 
-    size_t readSize = clusterSize - pos.clusterOffset;
-    readSize = std::min(readSize, readCount);
+// Up to count clusters of the chain from cluster on, merged into runs of
+// adjacent ones. cluster is moved past them
+static std::vector<CacheRange> getRanges(FatTable &fat, Region &dataRegion,
+                                         size_t clusterSize, uint16_t &cluster,
+                                         size_t count) {
+    std::vector<CacheRange> ranges;
 
-    memory.get()->push(ptr, readSize);
-    return readSize;
+    for (size_t i = 0; i < count && isDataCluster(cluster); i++) {
+        uint8_t *ptr = dataRegion.ptr + ((cluster - 2) * clusterSize);
+
+        if (!ranges.empty() &&
+            ranges.back().ptr + ranges.back().size == ptr) {
+            ranges.back().size += clusterSize;
+        } else {
+            ranges.push_back({ptr, clusterSize});
+        }
+
+        cluster = fat.get(cluster);
+    }
+
+    return ranges;
+}
+
+// Read all clusters of a request at once and start reading as many of the
+// clusters following them in the chain in the background, so that
+// sequential reads find them in the cache
+static void loadClusters(FatTable &fat, Region &dataRegion,
+                         size_t clusterSize, uint16_t cluster, size_t count) {
+    dataRegion.cache->load(
+        getRanges(fat, dataRegion, clusterSize, cluster, count));
+    dataRegion.cache->prefetch(
+        getRanges(fat, dataRegion, clusterSize, cluster, count));
 }
 
-static MemoryHdl dumpRegularFile(Region &fatRegion, Region &dataRegion,
-                                 FileEntry *file, size_t clusterSize,
-                                 size_t size, off_t offset) {
+static MemoryHdl dumpRegularFile(FatTable &fat, FileChain &chain,
+                                 Region &dataRegion, FileEntry *file,
+                                 size_t clusterSize, size_t size,
+                                 off_t offset) {
 
     // hexdump(dataRegion.ptr + ((clusterNumber - 2) * clusterSize),
     // clusterSize);
@@ -274,27 +647,52 @@ static MemoryHdl dumpRegularFile(Region &fatRegion, Region &dataRegion,
 
     MemoryHdl memory(std::make_unique<Memory>(size));
 
-    ClusterPos pos =
-        seek(fatRegion, file->firstDataClusterLow, clusterSize, offset);
+    size_t fileCluster = offset / clusterSize;
+    size_t clusterOffset = offset % clusterSize;
+    uint16_t cluster;
+    uint16_t previous;
 
-    if (pos.fileClusterOffset + pos.clusterOffset != (size_t)offset) {
+    if (!chain.locate(fat, file, fileCluster, cluster, previous) ||
+        !isDataCluster(cluster)) {
         printf("Cannot seek to position %zu\n", offset);
         throw EINVAL;
     }
 
+    if (dataRegion.cache) {
+        loadClusters(fat, dataRegion, clusterSize, cluster,
+                     (clusterOffset + toRead + clusterSize - 1) / clusterSize);
+    }
+
     size_t hasRead = 0;
 
-    while (pos.cluster != 0xFFF && hasRead != toRead) {
-        // printf("Cluster %hu [%d]\n", pos.cluster, pos.cluster - 2);
+    // Adjacent clusters are copied at once
+    while (hasRead != toRead && isDataCluster(cluster)) {
+        size_t run = 1;
 
-        int rd =
-            readCluster(dataRegion, clusterSize, pos, toRead - hasRead, memory);
+        while (run * clusterSize - clusterOffset < toRead - hasRead &&
+               fat.get(cluster + run - 1) == cluster + run) {
+            run++;
+        }
 
-        hasRead += rd;
+        uint8_t *ptr =
+            dataRegion.ptr + ((cluster - 2) * clusterSize) + clusterOffset;
+        size_t readSize =
+            std::min(run * clusterSize - clusterOffset, toRead - hasRead);
 
-        pos.cluster = getFatEntry(fatRegion, pos.cluster).getValue();
+        if (dataRegion.cache) {
+            dataRegion.cache->load(ptr, readSize);
+        }
 
-        pos.clusterOffset = 0;
+        memory.get()->push(ptr, readSize);
+
+        // The cluster the read ends in
+        size_t last = (clusterOffset + readSize - 1) / clusterSize;
+        chain.reached(fat, file, fileCluster + last, cluster + last);
+
+        hasRead += readSize;
+        fileCluster += run;
+        cluster = fat.get(cluster + run - 1);
+        clusterOffset = 0;
     }
 
     printf("Filesize %u hasRead, %zu\n", (uint32_t)file->size, hasRead);
@@ -303,16 +701,17 @@ static MemoryHdl dumpRegularFile(Region &fatRegion, Region &dataRegion,
 }
 
 std::unique_ptr<Memory> readFile(FileEntry *entry, Fat12Volume &volume,
-                                 size_t size, off_t off) {
-    return dumpRegularFile(volume.fatRegion, volume.dataRegion, entry,
+                                 FileChain &chain, size_t size, off_t off) {
+    return dumpRegularFile(volume.fat, chain, volume.dataRegion, entry,
                            volume.clusterSize, size, off);
 }
 
 static void wipe(Region &dataRegion, size_t clusterSize, uint16_t cluster,
                  int pattern) {
-    uint8_t *ptr = dataRegion.ptr + ((cluster - 2) * clusterSize);
+    uint8_t *ptr = getCluster(dataRegion, clusterSize, cluster);
 
     memset(ptr, pattern, clusterSize);
+    dataRegion.markDirty(ptr, clusterSize);
 }
 
 static size_t writeCluster(Region &dataRegion, size_t clusterSize,
@@ -321,13 +720,19 @@ static size_t writeCluster(Region &dataRegion, size_t clusterSize,
 
     // printf("------\n");
 
-    uint8_t *ptr =
-        dataRegion.ptr + ((pos.cluster - 2) * clusterSize) + pos.clusterOffset;
+    uint8_t *ptr = getCluster(dataRegion, clusterSize, pos.cluster) +
+                   pos.clusterOffset;
 
     size_t maxWriteSize = clusterSize - pos.clusterOffset;
     size_t toWrite = std::min(maxWriteSize, writeCount);
 
-    memcpy(ptr, data, toWrite);
+    if (data) {
+        memcpy(ptr, data, toWrite);
+    } else {
+        memset(ptr, 0, toWrite);
+    }
+
+    dataRegion.markDirty(ptr, toWrite);
 
     // printf("Write %p to %p, count %zu\n", ptr, data, toWrite);
     //  hexdump((uint8_t *)data, toWrite);
@@ -336,91 +741,93 @@ static size_t writeCluster(Region &dataRegion, size_t clusterSize,
     return toWrite;
 }
 
-static uint16_t getFreeCluster(Region &fatRegion, uint16_t maxCluster) {
-    for (uint16_t i = 0; i < maxCluster; i++) {
-        FatEntry entry = getFatEntry(fatRegion, i);
-
-        if (entry.getValue() == 0) {
-            return i;
-        }
-    }
-
-    return 0xfff;
-}
-
-static size_t writeFile(Region &fatRegion, Region &dataRegion, FileEntry *file,
-                        size_t clusterSize, size_t toWrite, off_t offset,
-                        const char *data, uint16_t maxCluster) {
+// Writes toWrite bytes of data, or zeros without data. Past the end of the
+// file the clusters for the rest of the write are appended as one run if
+// possible, and a gap from the end of the file to offset is filled with
+// zeros
+static size_t writeFile(FatTable &fat, FileChain &chain, Region &dataRegion,
+                        FileEntry *file, size_t clusterSize, size_t toWrite,
+                        off_t offset, const char *data) {
 
     printf("Write size %zu, offset %zu\n", toWrite, offset);
 
-    ClusterPos pos;
+    if (!toWrite) {
+        return 0;
+    }
+
+    if ((size_t)offset > file->size) {
+        size_t gap = offset - file->size;
 
-    pos = seek(fatRegion, file->firstDataClusterLow, clusterSize, offset);
+        if (writeFile(fat, chain, dataRegion, file, clusterSize, gap,
+                      file->size, 0) != gap) {
+            return 0;
+        }
+    }
 
-    if (pos.fileClusterOffset + pos.clusterOffset != (size_t)offset) {
-        printf("Seek to offset %zu failed -- seeked to: %zu\n", offset,
-               pos.fileClusterOffset);
+    // The cluster before the one to write first, for appending to the chain.
+    // The one to write first is only missing at the end of the chain
+    uint16_t tail;
+    uint16_t cluster;
+    size_t skipCluster = offset / clusterSize;
 
+    if (!chain.locate(fat, file, skipCluster, cluster, tail)) {
+        printf("Seek to offset %zu failed\n", offset);
         throw ESPIPE;
     }
 
-    size_t written = 0;
+    ClusterPos pos = {cluster, skipCluster * clusterSize,
+                      (uint32_t)(offset % clusterSize)};
 
-    if (!toWrite) {
-        return 0;
-    }
+    size_t written = 0;
 
-    if (file->firstDataClusterLow == 0) {
-        uint16_t newCluster = getFreeCluster(fatRegion, maxCluster);
-        printf("Allocate cluster  result: %hu\n", newCluster);
+    while (written != toWrite) {
+        if (!isDataCluster(pos.cluster)) {
+            size_t count = (pos.clusterOffset + toWrite - written +
+                            clusterSize - 1) /
+                           clusterSize;
 
-        if (newCluster == 0xFFF)
-            return 0;
+            pos.cluster = fat.allocate(tail, count);
+            printf("Allocate %zu clusters result: %hu\n", count, pos.cluster);
 
-        file->firstDataClusterLow = newCluster;
+            if (pos.cluster == 0xFFF) {
+                break;
+            }
 
-        getFatEntry(fatRegion, newCluster).setValue(0xFFF);
-        pos.cluster = newCluster;
-    }
+            if (!tail) {
+                file->firstDataClusterLow = pos.cluster;
+            }
+        }
 
-    while (written != toWrite) {
         printf("Write cluster: %hu, clusterOffset: %u, fileCOffset: %zu\n",
                pos.cluster, pos.clusterOffset, pos.fileClusterOffset);
 
         written += writeCluster(dataRegion, clusterSize, pos, toWrite - written,
-                                data + written);
-
-        if (written != toWrite) {
-            FatEntry curEntry = getFatEntry(fatRegion, pos.cluster);
+                                data ? data + written : 0);
 
-            if (curEntry.getValue() == 0xFFF) {
-                pos.cluster = getFreeCluster(fatRegion, maxCluster);
-                printf("Allocate cluster result: %hu\n", pos.cluster);
-                if (pos.cluster == 0xFFF) {
-                    return written;
-                }
+        tail = pos.cluster;
+        pos.cluster = fat.get(pos.cluster);
+        pos.clusterOffset = 0;
+        pos.fileClusterOffset += clusterSize;
+    }
 
-                curEntry.setValue(pos.cluster);
-                getFatEntry(fatRegion, pos.cluster).setValue(0xFFF);
-                pos.clusterOffset = 0;
-            } else {
-                pos.cluster = curEntry.getValue();
-                pos.clusterOffset = 0;
-            }
-        }
+    if (written) {
+        chain.reached(fat, file, pos.fileClusterOffset / clusterSize - 1,
+                      tail);
     }
 
     file->size = std::max((uint32_t)(offset + written), (uint32_t)file->size);
+    dataRegion.markDirty(file, sizeof(*file));
 
     printf("Resulting file-size %u\n", (uint32_t)file->size);
 
     return written;
 }
 
-static void f_unlink(Region &fatRegion, FileEntry *file) {
+static void f_unlink(Fat12Volume &fat12Volume, FileEntry *file) {
     printf("CLUSTER %hu\n", (uint16_t)file->firstDataClusterLow);
 
+    fat12Volume.volume.markDirty(file, sizeof(*file));
+
     if (file->firstDataClusterLow == 0) {
         file->reset();
         return;
@@ -435,15 +842,14 @@ static void f_unlink(Region &fatRegion, FileEntry *file) {
     }
 
     while (1) {
-        FatEntry entry = getFatEntry(fatRegion, cluster);
+        uint16_t next = fat12Volume.fat.get(cluster);
+        fat12Volume.fat.set(cluster, 0);
 
-        if (entry.getValue() == 0xFFF) {
-            entry.setValue(0);
+        if (next == 0xFFF) {
             break;
         }
 
-        cluster = entry.getValue();
-        entry.setValue(0);
+        cluster = next;
     }
 
     file->reset();
@@ -452,16 +858,17 @@ static void f_unlink(Region &fatRegion, FileEntry *file) {
 class FuseFile {
   public:
     uint64_t handle;
-    Fat12Inode inode;
+    Fat12Inode *inode;
+    FileChain chain;
 
-    FuseFile(uint64_t handle_, Fat12Inode inode_)
+    FuseFile(uint64_t handle_, Fat12Inode *inode_)
         : handle(handle_), inode(inode_) {}
 };
 
 class Fat12DirEntry {
   public:
     uint32_t inode;
-    FileEntry entry;
+    std::string name;
 };
 
 class FuseDir {
@@ -470,32 +877,111 @@ class FuseDir {
     std::vector<Fat12DirEntry> entries;
 
     FuseDir(uint64_t handle_, Fat12Inode &parent) : handle(handle_) {
-        entries.reserve(parent.children.size());
-
-        for (Fat12Inode &child : parent.children) {
-            if (!child.zombie) {
-                entries.push_back({child.inode, *(child.file)});
+        for (Fat12Inode *child = parent.firstChild; child;
+             child = child->nextSibling) {
+            if (!child->zombie) {
+                entries.push_back({child->inode, child->name});
             }
         }
     }
 };
 
+// Persists the changes done to the mapped image so far, either through the
+// journal or a shadow copy
+class ImageWriter {
+  public:
+    std::string filename;
+    MemoryMap &image;
+    DirtyMap &dirty;
+    bool journaled;
+    ClusterCache *cache;
+
+    ImageWriter(const std::string &filename_, MemoryMap &image_,
+                DirtyMap &dirty_, bool journaled_, ClusterCache *cache_)
+        : filename(filename_), image(image_), dirty(dirty_),
+          journaled(journaled_), cache(cache_) {}
+
+    bool write(std::vector<Fat12Volume> &fat12Volumes) {
+        for (Fat12Volume &fat12Volume : fat12Volumes) {
+            fat12Volume.fat.flush();
+        }
+
+        if (journaled) {
+            return writeBackJournaled(filename, image.data, image.size, dirty);
+        }
+
+        if (!writeBackImage(filename, image.data, image.size, dirty)) {
+            return false;
+        }
+
+        // Clusters dropped from the cache need to be read from the new image
+        if (cache) {
+            cache->reopen(filename);
+        }
+
+        return true;
+    }
+};
+
+class CheckpointThread;
+
 class FuseContext {
   public:
-    Fat12Volume &fat12Volume;
-    uint32_t inodeCounter;
+    std::vector<Fat12Volume> &fat12Volumes;
+    ImageWriter &imageWriter;
+    bool readOnly;
     FileEntry entry;
-    Fat12Inode rootInode;
+    std::vector<FileEntry> volumeEntries;
+    InodeTable inodes;
     Mutex mutex;
     std::vector<std::unique_ptr<FuseFile>> activeFiles;
     std::vector<std::unique_ptr<FuseDir>> activeDirs;
+    CheckpointThread *checkpointThread = 0;
+
+    // A single volume is mounted as is. Several ones show up as directories
+    // PART0, PART1 ... in the order they were found
+    FuseContext(std::vector<Fat12Volume> &fat12Volumes_,
+                ImageWriter &imageWriter_, bool readOnly_)
+        : fat12Volumes(fat12Volumes_), imageWriter(imageWriter_),
+          readOnly(readOnly_), entry("root      ", ATTR_DIRECTORY),
+          volumeEntries(fat12Volumes.size() > 1 ? fat12Volumes.size() : 0) {
+
+        if (volumeEntries.empty()) {
+            inodes.addVolumeRoot(0, fat12Volumes[0], &entry);
+            return;
+        }
+
+        Fat12Inode &rootInode = inodes.addRoot(&entry);
 
-    FuseContext(Fat12Volume &fat12Volume_)
-        : fat12Volume(fat12Volume_), inodeCounter(FUSE_ROOT_ID),
-          entry("root      ", ATTR_DIRECTORY),
-          rootInode(fat12Volume, &entry,
-                    fat12Volume.regionBPB.bootBlock.rootEntries,
-                    fat12Volume.rootRegion.ptr, inodeCounter) {}
+        for (size_t i = 0; i < volumeEntries.size(); i++) {
+            char name[32];
+            snprintf(name, sizeof(name), "PART%-4zu   ", i);
+
+            memcpy(volumeEntries[i].filename, name,
+                   sizeof(volumeEntries[i].filename));
+            volumeEntries[i].attr = ATTR_DIRECTORY;
+
+            inodes.addVolumeRoot(&rootInode, fat12Volumes[i],
+                                 &volumeEntries[i]);
+        }
+    }
+
+    // Write all changes done so far to the image, while staying mounted.
+    // The mutex needs to be held
+    bool checkpoint() {
+        bool dirty = !imageWriter.dirty.empty();
+
+        for (Fat12Volume &fat12Volume : fat12Volumes) {
+            dirty = dirty || fat12Volume.fat.isDirty();
+        }
+
+        if (!dirty) {
+            return true;
+        }
+
+        printf("Checkpoint, %zu bytes dirty\n", imageWriter.dirty.dirtyBytes());
+        return imageWriter.write(fat12Volumes);
+    }
 
     bool existsFile(uint64_t handle) {
         for (auto &cDir : activeFiles) {
@@ -565,7 +1051,7 @@ class FuseContext {
 
     bool isInUse(uint32_t inode) {
         for (size_t i = 0; i < activeFiles.size(); i++) {
-            if (activeFiles[i]->inode.inode == inode) {
+            if (activeFiles[i]->inode->inode == inode) {
                 return true;
             }
         }
@@ -574,6 +1060,81 @@ class FuseContext {
     }
 };
 
+// Periodically writes the changes of a long running mount to the image. A
+// checkpoint is done every interval seconds (if there is anything to write),
+// or earlier when requested, i.e. when the dirty threshold is exceeded
+class CheckpointThread {
+    FuseContext &context;
+    unsigned int interval;
+    size_t dirtyThreshold;
+    Condition condition;
+    bool requested = false;
+    bool stop = false;
+    pthread_t thread;
+
+    static void *run(void *arg) {
+        CheckpointThread *self = (CheckpointThread *)arg;
+        LockGuard lg(self->context.mutex);
+
+        while (!self->stop) {
+            if (!self->requested) {
+                self->condition.wait(self->context.mutex, self->interval);
+            }
+
+            if (self->stop) {
+                break;
+            }
+
+            self->requested = false;
+
+            try {
+                if (!self->context.checkpoint()) {
+                    printf("Checkpoint failed\n");
+                }
+            } catch (...) {
+                printf("Checkpoint failed\n");
+            }
+        }
+
+        return 0;
+    }
+
+  public:
+    CheckpointThread(FuseContext &context_, unsigned int interval_,
+                     size_t dirtyThreshold_)
+        : context(context_), interval(interval_),
+          dirtyThreshold(dirtyThreshold_) {
+        if (pthread_create(&thread, 0, run, this) != 0) {
+            printf("Cannot start checkpoint thread\n");
+            throw -1;
+        }
+    }
+
+    ~CheckpointThread() {
+        {
+            LockGuard lg(context.mutex);
+            stop = true;
+            condition.signal();
+        }
+
+        pthread_join(thread, 0);
+    }
+
+    // The context mutex needs to be held
+    void request() {
+        requested = true;
+        condition.signal();
+    }
+
+    // The context mutex needs to be held
+    void notifyWrite() {
+        if (dirtyThreshold &&
+            context.imageWriter.dirty.dirtyBytes() >= dirtyThreshold) {
+            request();
+        }
+    }
+};
+
 static void getFAT12TimeDate(struct tm curDateTime, uint16_t &dateRet,
                              uint16_t &clockRet) {
     dateRet = 0;
@@ -672,11 +1233,13 @@ static void getDateTimeFromFAT(uint16_t date, uint16_t clock,
 static int fat12_stat(fuse_ino_t ino, FuseContext *userdata,
                       struct stat *stbuf) {
 
-    FileEntry *entry = userdata->rootInode.find(ino);
+    Fat12Inode *inode = userdata->inodes.find(ino);
 
-    if (!entry)
+    if (!inode)
         return -1;
 
+    FileEntry *entry = inode->file;
+
     stbuf->st_ino = ino;
     stbuf->st_size = entry->size;
 
@@ -705,24 +1268,83 @@ static int fat12_stat(fuse_ino_t ino, FuseContext *userdata,
     return 0;
 }
 
-static void fat12_ll_getattr(fuse_req_t req, fuse_ino_t ino,
-                             struct fuse_file_info *fi) {
+static void fat12_ll_getattr(fuse_req_t req, fuse_ino_t ino,
+                             struct fuse_file_info *fi) {
+
+    try {
+        (void)fi;
+
+        FuseContext *userdata = (FuseContext *)fuse_req_userdata(req);
+        LockGuard lg(userdata->mutex);
+
+        struct stat stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+
+        if (fat12_stat(ino, userdata, &stbuf) == -1) {
+            fuse_reply_err(req, ENOENT);
+        } else {
+            fuse_reply_attr(req, &stbuf, 1.0);
+        }
+
+    } catch (int err) {
+        fuse_reply_err(req, err);
+    } catch (...) {
+        fuse_reply_err(req, ENOMEM);
+    }
+}
+
+// The free clusters come from the count FatTable keeps up to date, so this
+// does not need to go through the FAT
+static void fat12_ll_statfs(fuse_req_t req, fuse_ino_t ino) {
+
+    try {
+        FuseContext *userdata = (FuseContext *)fuse_req_userdata(req);
+        LockGuard lg(userdata->mutex);
+
+        Fat12Inode *inode = userdata->inodes.find(ino);
+
+        if (!inode) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
+
+        struct statvfs stbuf;
+        memset(&stbuf, 0, sizeof(stbuf));
+
+        // The directory holding several volumes sums them up, in sectors as
+        // their cluster sizes may differ
+        std::vector<Fat12Volume *> volumes;
+
+        if (inode->volume) {
+            volumes.push_back(inode->volume);
+            stbuf.f_bsize = inode->volume->clusterSize;
+        } else {
+            for (Fat12Volume &volume : userdata->fat12Volumes) {
+                volumes.push_back(&volume);
+            }
+
+            stbuf.f_bsize = 512;
+        }
 
-    try {
-        (void)fi;
+        for (Fat12Volume *volume : volumes) {
+            size_t clusters =
+                volume->maxCluster > 2 ? volume->maxCluster - 2 : 0;
+            size_t blocksPerCluster = volume->clusterSize / stbuf.f_bsize;
 
-        FuseContext *userdata = (FuseContext *)fuse_req_userdata(req);
-        LockGuard lg(userdata->mutex);
+            stbuf.f_blocks += clusters * blocksPerCluster;
+            stbuf.f_bfree += volume->fat.freeCount() * blocksPerCluster;
+        }
 
-        struct stat stbuf;
-        memset(&stbuf, 0, sizeof(stbuf));
+        stbuf.f_frsize = stbuf.f_bsize;
+        stbuf.f_bavail = stbuf.f_bfree;
+        stbuf.f_namemax = 12;
 
-        if (fat12_stat(ino, userdata, &stbuf) == -1) {
-            fuse_reply_err(req, ENOENT);
-        } else {
-            fuse_reply_attr(req, &stbuf, 1.0);
+        if (userdata->readOnly) {
+            stbuf.f_flag = ST_RDONLY;
         }
 
+        fuse_reply_statfs(req, &stbuf);
+
     } catch (int err) {
         fuse_reply_err(req, err);
     } catch (...) {
@@ -730,34 +1352,26 @@ static void fat12_ll_getattr(fuse_req_t req, fuse_ino_t ino,
     }
 }
 
-static void lookup(fuse_req_t req, const char *name,
-                   std::vector<Fat12Inode> &children) {
+static void lookup(fuse_req_t req, const char *name, Fat12Inode &parent) {
 
     FuseContext *userdata = (FuseContext *)fuse_req_userdata(req);
 
-    for (size_t i = 0; i < children.size(); i++) {
-        if (children[i].zombie)
-            continue;
-
-        FileEntry *entry = children[i].file;
-
-        std::string canonicalFilename = getCanonicalString(entry->filename);
+    Fat12Inode *child = userdata->inodes.findChild(parent, name);
 
-        if (strcasecmp(canonicalFilename.c_str(), name) == 0) {
-            printf("Name found %s\n", name);
+    if (child) {
+        printf("Name found %s\n", name);
 
-            struct fuse_entry_param e;
-            memset(&e, 0, sizeof(e));
-            e.ino = children[i].inode;
-            e.attr_timeout = 1.0;
-            e.entry_timeout = 1.0;
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof(e));
+        e.ino = child->inode;
+        e.attr_timeout = 1.0;
+        e.entry_timeout = 1.0;
 
-            fat12_stat(children[i].inode, userdata, &e.attr);
+        fat12_stat(child->inode, userdata, &e.attr);
 
-            children[i].nlookup++;
-            fuse_reply_entry(req, &e);
-            return;
-        }
+        child->nlookup++;
+        fuse_reply_entry(req, &e);
+        return;
     }
 
     printf("Not found %s\n", name);
@@ -772,14 +1386,12 @@ static void fat12_ll_lookup(fuse_req_t req, fuse_ino_t parent,
         FuseContext *context = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(context->mutex);
 
-        Fat12Inode &rootInode = context->rootInode;
-
         printf("Lookup name %s\n", name);
 
-        Fat12Inode *inode = rootInode.findInode(parent);
+        Fat12Inode *inode = context->inodes.find(parent);
 
         if (inode) {
-            lookup(req, name, inode->children);
+            lookup(req, name, *inode);
             return;
         }
 
@@ -800,12 +1412,10 @@ static size_t getDirectoryInodeBufferSize(fuse_req_t req,
     size_t curSize = 0;
 
     for (size_t i = off; i < entries.size(); i++) {
-        const FileEntry &entry = entries[i].entry;
-        std::string filename = getCanonicalString(entry.filename);
         stbuf.st_ino = entries[i].inode;
 
-        size_t entrysize =
-            fuse_add_direntry(req, 0, 0, filename.c_str(), &stbuf, i + 1);
+        size_t entrysize = fuse_add_direntry(
+            req, 0, 0, entries[i].name.c_str(), &stbuf, i + 1);
 
         if (curSize + entrysize < maxSize) {
             curSize += entrysize;
@@ -824,19 +1434,13 @@ static void addDirectoryInode(FuseContext *userdata, std::vector<uint8_t> &vec,
     size_t bufsz = 0;
 
     for (size_t i = off; i < entries.size(); i++) {
-        const FileEntry &entry = entries[i].entry;
-        // printFileEntry(*entry, 0);
-        //  hexdump((uint8_t *)entry, sizeof(*entry));
-
-        std::string filename = getCanonicalString(entry.filename);
-
         struct stat stbuf;
         memset(&stbuf, 0, sizeof(stbuf));
         fat12_stat(entries[i].inode, userdata, &stbuf);
 
-        size_t addch = fuse_add_direntry(req, (char *)vec.data() + bufsz,
-                                         vec.size() - bufsz, filename.c_str(),
-                                         &stbuf, i + 1);
+        size_t addch = fuse_add_direntry(
+            req, (char *)vec.data() + bufsz, vec.size() - bufsz,
+            entries[i].name.c_str(), &stbuf, i + 1);
 
         if (bufsz + addch < maxSize) {
             bufsz += addch;
@@ -853,9 +1457,11 @@ static void fat12_ll_opendir(fuse_req_t req, fuse_ino_t ino,
         FuseContext *context = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(context->mutex);
 
-        Fat12Inode *fat12Inode = context->rootInode.findInode(ino);
+        Fat12Inode *fat12Inode = context->inodes.find(ino);
 
         if (fat12Inode) {
+            context->inodes.load(*fat12Inode);
+
             uint64_t handle = context->getFreeFileHandle();
 
             context->activeDirs.push_back(
@@ -929,7 +1535,7 @@ static void fat12_ll_releasedir(fuse_req_t req, fuse_ino_t ino,
     }
 }
 
-static void trunc(FileEntry *entry, Region &fatRegion) {
+static void trunc(FileEntry *entry, FatTable &fat) {
 
     if (entry->size == 0 || entry->firstDataClusterLow == 0) {
         return;
@@ -938,10 +1544,10 @@ static void trunc(FileEntry *entry, Region &fatRegion) {
     uint16_t cluster = entry->firstDataClusterLow;
 
     while (cluster != 0xFFF) {
-        FatEntry fatEntry = getFatEntry(fatRegion, cluster);
+        uint16_t next = fat.get(cluster);
         // printf("TRUNC cluster %hu\n", cluster);
-        cluster = fatEntry.getValue();
-        fatEntry.setValue(0x000);
+        fat.set(cluster, 0x000);
+        cluster = next;
     }
 
     entry->firstDataClusterLow = 0;
@@ -954,7 +1560,7 @@ static void fat12_ll_open(fuse_req_t req, fuse_ino_t ino,
         FuseContext *userdata = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(userdata->mutex);
 
-        Fat12Inode *fileNode = userdata->rootInode.findInode(ino);
+        Fat12Inode *fileNode = userdata->inodes.find(ino);
 
         if (!fileNode) {
             fuse_reply_err(req, ENOENT);
@@ -968,6 +1574,13 @@ static void fat12_ll_open(fuse_req_t req, fuse_ino_t ino,
             return;
         }
 
+        bool writes = fi->flags & (O_WRONLY | O_RDWR | O_TRUNC);
+
+        if (writes && userdata->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
         if ((fi->flags & O_WRONLY || fi->flags & O_RDWR) && fileEntry->isRO()) {
             fuse_reply_err(req, EACCES);
             return;
@@ -976,15 +1589,16 @@ static void fat12_ll_open(fuse_req_t req, fuse_ino_t ino,
         if (fi->flags & O_TRUNC) {
             // printf("TRUNC requested\n");
 
-            trunc(fileEntry, userdata->fat12Volume.fatRegion);
+            trunc(fileEntry, fileNode->volume->fat);
             fileEntry->size = 0;
+            fileNode->volume->volume.markDirty(fileEntry, sizeof(*fileEntry));
         }
 
         uint64_t fileHandle = userdata->getFreeFileHandle();
 
         try {
             userdata->activeFiles.push_back(
-                std::make_unique<FuseFile>(fileHandle, *fileNode));
+                std::make_unique<FuseFile>(fileHandle, fileNode));
 
             printf("Open inode %zu\n", ino);
 
@@ -1026,7 +1640,8 @@ static void fat12_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         }
 
         std::unique_ptr<Memory> memory =
-            readFile(fuseFile->inode.file, userdata->fat12Volume, size, off);
+            readFile(fuseFile->inode->file, *fuseFile->inode->volume,
+                     fuseFile->chain, size, off);
 
         fuse_reply_buf(req, (char *)(memory->bytes), memory->used);
 
@@ -1057,6 +1672,53 @@ static void fat12_ll_release(fuse_req_t req, fuse_ino_t ino,
     }
 }
 
+static void fat12_ll_flush(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+    (void)ino;
+    (void)fi;
+
+    try {
+        FuseContext *context = (FuseContext *)fuse_req_userdata(req);
+        LockGuard lg(context->mutex);
+
+        // Called on every close() -- the changes are persisted by the
+        // checkpoint thread on its own schedule, or right away by fsync
+        if (context->checkpointThread) {
+            context->checkpointThread->notifyWrite();
+        }
+
+        fuse_reply_err(req, 0);
+
+    } catch (int err) {
+        fuse_reply_err(req, err);
+    } catch (...) {
+        fuse_reply_err(req, ENOMEM);
+    }
+}
+
+static void fat12_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                           struct fuse_file_info *fi) {
+    (void)ino;
+    (void)datasync;
+    (void)fi;
+
+    try {
+        FuseContext *context = (FuseContext *)fuse_req_userdata(req);
+        LockGuard lg(context->mutex);
+
+        if (context->checkpoint()) {
+            fuse_reply_err(req, 0);
+        } else {
+            fuse_reply_err(req, EIO);
+        }
+
+    } catch (int err) {
+        fuse_reply_err(req, err);
+    } catch (...) {
+        fuse_reply_err(req, ENOMEM);
+    }
+}
+
 template <class T1> class RevertData {
     T1 *original;
     T1 backup;
@@ -1090,6 +1752,24 @@ template <class T1> class RevertVectorPush {
     }
 };
 
+class RevertInode {
+    InodeTable &inodes;
+    uint32_t inode;
+    bool revert = true;
+
+  public:
+    RevertInode(InodeTable &inodes_, uint32_t inode_)
+        : inodes(inodes_), inode(inode_) {}
+
+    void drop() { revert = false; }
+
+    ~RevertInode() {
+        if (revert) {
+            inodes.remove(inode);
+        }
+    }
+};
+
 class RevertFileHandle {
     FuseContext &fuseContext;
     uint64_t handle;
@@ -1116,6 +1796,11 @@ static void fat12_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
         FuseContext *fuseContext = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(fuseContext->mutex);
 
+        if (fuseContext->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
         uint8_t dosName[11];
         if (!getDOSName((uint8_t *)name, dosName)) {
             printf("Name invalid -- Cannot create node\n");
@@ -1123,19 +1808,26 @@ static void fat12_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
             return;
         }
 
-        Fat12Inode *inode = fuseContext->rootInode.findInode(parent);
+        Fat12Inode *inode = fuseContext->inodes.find(parent);
         if (!inode) {
             printf("Cannot find inode in which to create entry\n");
             fuse_reply_err(req, ENOTDIR);
             return;
         }
 
-        RevertData revertFat12Inode(inode);
+        if (!inode->volume) {
+            printf("Cannot create entry outside of the volumes\n");
+            fuse_reply_err(req, EPERM);
+            return;
+        }
+
+        // Otherwise the new entry would be found by the scan as well
+        fuseContext->inodes.load(*inode);
 
         uint64_t handle = fuseContext->getFreeFileHandle();
         RevertFileHandle revertHandle(*fuseContext, handle);
 
-        FileEntry *entry = inode->getFreeFileEntry(fuseContext->fat12Volume);
+        FileEntry *entry = inode->getFreeFileEntry();
 
         if (!entry) {
             printf("Cannot allocate additional entry\n");
@@ -1179,17 +1871,15 @@ static void fat12_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
             entry->writeDate = dateRet;
         }
 
-        Fat12Inode newInode(fuseContext->fat12Volume, entry,
-                            fuseContext->inodeCounter);
+        inode->volume->volume.markDirty(entry, sizeof(*entry));
 
-        newInode.nlookup = 1;
-
-        inode->children.push_back(newInode);
+        Fat12Inode &newInode = fuseContext->inodes.add(inode, entry);
+        RevertInode revertNewInode(fuseContext->inodes, newInode.inode);
 
-        RevertVectorPush revertVectorInode(inode->children);
+        newInode.nlookup = 1;
 
         fuseContext->activeFiles.push_back(
-            std::make_unique<FuseFile>(handle, newInode));
+            std::make_unique<FuseFile>(handle, &newInode));
 
         RevertVectorPush revertVectorActiveFiles(fuseContext->activeFiles);
 
@@ -1205,9 +1895,8 @@ static void fat12_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 
         revertFileEntry.drop();
         revertHandle.drop();
-        revertFat12Inode.drop();
 
-        revertVectorInode.drop();
+        revertNewInode.drop();
         revertVectorActiveFiles.drop();
 
         fuse_reply_create(req, &e, fi);
@@ -1230,6 +1919,11 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         FuseContext *fuseContext = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(fuseContext->mutex);
 
+        if (fuseContext->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
         uint8_t dosName[11];
         if (!getDOSName((uint8_t *)name, dosName)) {
             printf("Name invalid -- Cannot create node\n");
@@ -1237,17 +1931,22 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
             return;
         }
 
-        Fat12Inode *parentInode = fuseContext->rootInode.findInode(parent);
+        Fat12Inode *parentInode = fuseContext->inodes.find(parent);
         if (!parentInode) {
             printf("Cannot find inode in which to create entry\n");
             fuse_reply_err(req, ENOTDIR);
             return;
         }
 
-        RevertData revertFat12Inode(parentInode);
+        if (!parentInode->volume) {
+            printf("Cannot create entry outside of the volumes\n");
+            fuse_reply_err(req, EPERM);
+            return;
+        }
+
+        fuseContext->inodes.load(*parentInode);
 
-        FileEntry *newEntry =
-            parentInode->getFreeFileEntry(fuseContext->fat12Volume);
+        FileEntry *newEntry = parentInode->getFreeFileEntry();
 
         if (!newEntry) {
             printf("Cannot allocate additional entry\n");
@@ -1292,10 +1991,10 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
             newEntry->writeDate = dateRet;
         }
 
-        Fat12Volume &volume = fuseContext->fat12Volume;
+        Fat12Volume &volume = *parentInode->volume;
+        volume.volume.markDirty(newEntry, sizeof(*newEntry));
 
-        uint16_t newCluster =
-            getFreeCluster(volume.fatRegion, volume.maxCluster);
+        uint16_t newCluster = volume.fat.findFree();
 
         if (newCluster == 0xFFF) {
             printf("Cannot alloc new cluster for directory\n");
@@ -1322,8 +2021,7 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 
             ClusterPos pos = {newCluster, 0, 0};
 
-            FatEntry fatEntry = getFatEntry(volume.fatRegion, newCluster);
-            fatEntry.setValue(0xFFF);
+            volume.fat.set(newCluster, 0xFFF);
 
             wipe(volume.dataRegion, volume.clusterSize, newCluster, 0x00);
 
@@ -1331,12 +2029,10 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
                                sizeof(dirs), (const char *)dirs);
         }
 
-        Fat12Inode newInode(fuseContext->fat12Volume, newEntry,
-                            fuseContext->inodeCounter);
+        Fat12Inode &newInode = fuseContext->inodes.add(parentInode, newEntry);
+        RevertInode revertNewInode(fuseContext->inodes, newInode.inode);
 
         newInode.nlookup = 1;
-        parentInode->children.push_back(newInode);
-        RevertVectorPush revertVectorInode(parentInode->children);
 
         struct fuse_entry_param e;
         memset(&e, 0, sizeof(e));
@@ -1347,9 +2043,7 @@ static void fat12_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
         fat12_stat(newInode.inode, fuseContext, &e.attr);
 
         revertFileEntry.drop();
-        revertFat12Inode.drop();
-
-        revertVectorInode.drop();
+        revertNewInode.drop();
 
         fuse_reply_entry(req, &e);
 
@@ -1370,6 +2064,11 @@ static void fat12_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         FuseContext *fuseContext = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(fuseContext->mutex);
 
+        if (fuseContext->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
         FuseFile *fuseFile = fuseContext->getOpenFile(fi->fh);
 
         if (!fuseFile) {
@@ -1378,11 +2077,16 @@ static void fat12_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
             return;
         }
 
+        Fat12Volume &volume = *fuseFile->inode->volume;
+
         size_t sz =
-            writeFile(fuseContext->fat12Volume.fatRegion,
-                      fuseContext->fat12Volume.dataRegion, fuseFile->inode.file,
-                      fuseContext->fat12Volume.clusterSize, size, off, buf,
-                      fuseContext->fat12Volume.maxCluster);
+            writeFile(volume.fat, fuseFile->chain, volume.dataRegion,
+                      fuseFile->inode->file, volume.clusterSize, size, off,
+                      buf);
+
+        if (fuseContext->checkpointThread) {
+            fuseContext->checkpointThread->notifyWrite();
+        }
 
         if (sz == 0) {
             fuse_reply_err(req, ENOSPC);
@@ -1397,6 +2101,79 @@ static void fat12_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
     }
 }
 
+// FAT has no holes, so the clusters up to the end of a file are always
+// allocated. Growing a file writes zeros to the new part, with all clusters
+// for it allocated in one go
+static void fat12_ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                               off_t offset, off_t length,
+                               struct fuse_file_info *fi) {
+
+    printf("Fallocate ino %lu, mode %d, off %lu, length %lu\n", ino, mode,
+           offset, length);
+
+    try {
+        FuseContext *fuseContext = (FuseContext *)fuse_req_userdata(req);
+        LockGuard lg(fuseContext->mutex);
+
+        if (fuseContext->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
+
+        if (mode != 0) {
+            fuse_reply_err(req, EOPNOTSUPP);
+            return;
+        }
+
+        FuseFile *fuseFile = fuseContext->getOpenFile(fi->fh);
+
+        if (!fuseFile) {
+            printf("Cannot address file, which should currently be opened\n");
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+
+        Fat12Volume &volume = *fuseFile->inode->volume;
+        FileEntry *file = fuseFile->inode->file;
+
+        size_t size = file->size;
+        size_t end = offset + length;
+
+        if (end <= size) {
+            fuse_reply_err(req, 0);
+            return;
+        }
+
+        if (end > UINT32_MAX) {
+            fuse_reply_err(req, EFBIG);
+            return;
+        }
+
+        size_t clusterSize = volume.clusterSize;
+        size_t needed = (end + clusterSize - 1) / clusterSize -
+                        (size + clusterSize - 1) / clusterSize;
+
+        if (needed > volume.fat.freeCount()) {
+            fuse_reply_err(req, ENOSPC);
+            return;
+        }
+
+        size_t sz = writeFile(volume.fat, fuseFile->chain, volume.dataRegion,
+                              file, clusterSize, end - size, size, 0);
+
+        if (fuseContext->checkpointThread) {
+            fuseContext->checkpointThread->notifyWrite();
+        }
+
+        fuse_reply_err(req, sz == end - size ? 0 : ENOSPC);
+
+    } catch (int err) {
+        fuse_reply_err(req, err);
+    } catch (...) {
+        fuse_reply_err(req, ENOMEM);
+    }
+}
+
 static void cleanDirectoryFilesRoot(Region &rootRegion, uint16_t rootEntries) {
     // Root, use root region
 
@@ -1407,6 +2184,7 @@ static void cleanDirectoryFilesRoot(Region &rootRegion, uint16_t rootEntries) {
             break;
         } else {
             entry->filename[0] = 0;
+            rootRegion.markDirty(entry->filename, 1);
         }
 
         entry--;
@@ -1417,7 +2195,7 @@ static void cleanDirectoryFilesRoot(Region &rootRegion, uint16_t rootEntries) {
     }
 }
 
-static void cleanDirectoryFilesEntry(FileEntry *dir, Region &fatRegion,
+static void cleanDirectoryFilesEntry(FileEntry *dir, FatTable &fat,
                                      Region &dataRegion, uint32_t clusterSize) {
     assert(dir->isDirectory());
 
@@ -1431,7 +2209,7 @@ static void cleanDirectoryFilesEntry(FileEntry *dir, Region &fatRegion,
     while (clusterNumber != 0xFFF) {
 
         uint8_t *curBuffer =
-            dataRegion.ptr + ((clusterNumber - 2) * clusterSize);
+            getCluster(dataRegion, clusterSize, clusterNumber, true);
 
         size_t entriesPerCluster = clusterSize / 32;
 
@@ -1445,7 +2223,7 @@ static void cleanDirectoryFilesEntry(FileEntry *dir, Region &fatRegion,
             counter++;
         }
 
-        clusterNumber = getFatEntry(fatRegion, clusterNumber).getValue();
+        clusterNumber = fat.get(clusterNumber);
     }
 
     clusterNumber = dir->firstDataClusterLow;
@@ -1455,31 +2233,32 @@ static void cleanDirectoryFilesEntry(FileEntry *dir, Region &fatRegion,
         size_t entriesPerCluster = clusterSize / 32;
 
         uint8_t *curBuffer =
-            dataRegion.ptr + ((clusterNumber - 2) * clusterSize);
+            getCluster(dataRegion, clusterSize, clusterNumber, true);
 
         for (uint16_t i = 0; i < entriesPerCluster; i++) {
             if (lastValidEntry + 1 <= curEntry) {
                 FileEntry *entry = (FileEntry *)(curBuffer + i * 32);
                 entry->filename[0] = 0x00;
+                dataRegion.markDirty(entry->filename, 1);
             }
 
             curEntry++;
         }
 
-        clusterNumber = getFatEntry(fatRegion, clusterNumber).getValue();
+        clusterNumber = fat.get(clusterNumber);
     }
 }
 
 static void cleanDirectoryFiles(Fat12Inode &fuseDir, BPB &bootBlock,
-                                Region &rootRegion, Region &fatRegion,
+                                Region &rootRegion, FatTable &fat,
                                 Region &dataRegion, uint32_t clusterSize) {
     // All files after the last valid file should have the first byte of their
     // filename set to 0
 
-    if (fuseDir.inode == FUSE_ROOT_ID) {
+    if (fuseDir.volumeRoot) {
         cleanDirectoryFilesRoot(rootRegion, bootBlock.rootEntries);
     } else {
-        cleanDirectoryFilesEntry(fuseDir.file, fatRegion, dataRegion,
+        cleanDirectoryFilesEntry(fuseDir.file, fat, dataRegion,
                                  clusterSize);
     }
 }
@@ -1490,37 +2269,49 @@ static void fat12_ll_rmdir(fuse_req_t req, fuse_ino_t parent,
     try {
         FuseContext *context = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(context->mutex);
-        Fat12Inode &rootInode = context->rootInode;
+
+        if (context->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
 
         printf("Rmdir %s\n", name);
 
-        Fat12Inode *parentNode = rootInode.findInode(parent);
+        Fat12Inode *parentNode = context->inodes.find(parent);
+
+        if (parentNode && !parentNode->volume) {
+            fuse_reply_err(req, EPERM);
+            return;
+        }
 
-        if (parentNode) {
-            for (size_t i = 0; i < parentNode->children.size(); i++) {
-                Fat12Inode &child = parentNode->children[i];
+        Fat12Inode *node =
+            parentNode ? context->inodes.findChild(*parentNode, name, true)
+                       : 0;
 
-                if (!child.zombie &&
-                    getCanonicalString(child.file->filename) == name) {
-                    // . and .. and zombies should be present -- nothing else
-                    if (child.children.size() < 2) {
-                        fuse_reply_err(req, EFAULT);
-                        return;
-                    }
+        if (node) {
+            Fat12Inode &child = *node;
+            context->inodes.load(child);
 
-                    for (size_t i = 2; i < child.children.size(); i++) {
-                        if (!child.children[i].zombie) {
-                            printf("Directory is not empty\n");
-                            fuse_reply_err(req, ENOTEMPTY);
-                            return;
-                        }
-                    }
+            // . and .. and zombies should be present -- nothing else
+            Fat12Inode *dot = child.firstChild;
+
+            if (!dot || !dot->nextSibling) {
+                fuse_reply_err(req, EFAULT);
+                return;
+            }
 
-                    child.zombie = true;
-                    fuse_reply_err(req, 0);
+            for (Fat12Inode *entry = dot->nextSibling->nextSibling; entry;
+                 entry = entry->nextSibling) {
+                if (!entry->zombie) {
+                    printf("Directory is not empty\n");
+                    fuse_reply_err(req, ENOTEMPTY);
                     return;
                 }
             }
+
+            child.zombie = true;
+            fuse_reply_err(req, 0);
+            return;
         }
 
         fuse_reply_err(req, ENOENT);
@@ -1537,31 +2328,38 @@ static void fat12_ll_unlink(fuse_req_t req, fuse_ino_t parent,
 
         FuseContext *context = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(context->mutex);
-        Fat12Inode &rootInode = context->rootInode;
 
-        printf("Unlink %s\n", name);
+        if (context->readOnly) {
+            fuse_reply_err(req, EROFS);
+            return;
+        }
 
-        Fat12Inode *parentNode = rootInode.findInode(parent);
+        printf("Unlink %s\n", name);
 
-        if (parentNode) {
-            for (size_t i = 0; i < parentNode->children.size(); i++) {
-                Fat12Inode &child = parentNode->children[i];
+        Fat12Inode *parentNode = context->inodes.find(parent);
 
-                if (!child.zombie &&
-                    getCanonicalString(child.file->filename) == name) {
+        if (parentNode && !parentNode->volume) {
+            fuse_reply_err(req, EPERM);
+            return;
+        }
 
-                    if (context->isInUse(child.inode)) {
-                        fuse_reply_err(req, EBUSY);
-                        return;
-                    }
+        Fat12Inode *node =
+            parentNode ? context->inodes.findChild(*parentNode, name, true)
+                       : 0;
 
-                    printf("Lookup count %lu\n", child.nlookup);
+        if (node) {
+            Fat12Inode &child = *node;
 
-                    child.zombie = true;
-                    fuse_reply_err(req, 0);
-                    return;
-                }
+            if (context->isInUse(child.inode)) {
+                fuse_reply_err(req, EBUSY);
+                return;
             }
+
+            printf("Lookup count %lu\n", child.nlookup);
+
+            child.zombie = true;
+            fuse_reply_err(req, 0);
+            return;
         }
 
         fuse_reply_err(req, ENOENT);
@@ -1580,9 +2378,7 @@ static void fat12_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
         FuseContext *context = (FuseContext *)fuse_req_userdata(req);
         LockGuard lg(context->mutex);
 
-        Fat12Inode &rootInode = context->rootInode;
-        Fat12Volume fat12Volume = context->fat12Volume;
-        Fat12Inode *child = rootInode.findInode(ino);
+        Fat12Inode *child = context->inodes.find(ino);
 
         if (child) {
             printf("Lookup cur %lu, dec %lu\n", child->nlookup, nlookup);
@@ -1593,7 +2389,7 @@ static void fat12_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
                 printf("Delete ino %lu\n", ino);
                 printFileEntry(*child->file, 0);
 
-                Fat12Inode *parent = rootInode.findParent(ino);
+                Fat12Inode *parent = context->inodes.findParent(ino);
 
                 if (!parent) {
                     printf("Parent of %lu not found for unlinking\n", ino);
@@ -1604,17 +2400,19 @@ static void fat12_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
                 printf("Parent:\n");
                 printFileEntry(*parent->file, 0);
 
-                f_unlink(context->fat12Volume.fatRegion, child->file);
+                Fat12Volume &fat12Volume = *child->volume;
+
+                f_unlink(fat12Volume, child->file);
                 child->file->filename[0] = 0xE5;
+                fat12Volume.volume.markDirty(child->file->filename, 1);
 
                 cleanDirectoryFiles(
                     *parent, fat12Volume.regionBPB.bootBlock,
-                    fat12Volume.rootRegion, fat12Volume.fatRegion,
+                    fat12Volume.rootRegion, fat12Volume.fat,
                     fat12Volume.dataRegion, fat12Volume.clusterSize);
 
                 // TODO: Remove empty directory clusters
-                parent->children.erase(std::find(
-                    parent->children.begin(), parent->children.end(), *child));
+                context->inodes.remove(ino);
 
                 fuse_reply_none(req);
                 return;
@@ -1634,6 +2432,93 @@ static void fat12_ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
     fuse_reply_none(req);
 }
 
+// Find the volumes by reading only what is needed: the start of the image
+// for the partition tables, and the boot sectors they point to. If that does
+// not lead anywhere, the image is scanned piece by piece. The metadata of the
+// volumes stays in memory for good
+static std::vector<Fat12Volume> loadFatVolumes(ClusterCache &cache,
+                                               MemoryMap &image,
+                                               DirtyMap &dirty) {
+    const size_t chunkSize = 64 * 1024;
+    std::vector<size_t> bootOffsets;
+
+    size_t headSize = std::min(chunkSize, image.size);
+    cache.load(image.data, headSize);
+
+    for (size_t candidate :
+         getVolumeCandidates(image.data, headSize, image.size)) {
+        cache.load(image.data + candidate, 512);
+
+        if (isBootSector(image.data + candidate) &&
+            !isWithinVolumes(image.data, bootOffsets, candidate)) {
+            // Pinned, as isWithinVolumes looks at it again
+            cache.load(image.data + candidate, 512, true);
+            bootOffsets.push_back(candidate);
+        }
+    }
+
+    bool scan = bootOffsets.empty();
+
+    if (scan) {
+        printf("No volume at the start of the image or in its partition "
+               "table -- scan image\n");
+    }
+
+    for (size_t offset = 0; scan && offset < image.size;) {
+        size_t end = std::min(offset + chunkSize, image.size);
+
+        cache.load(image.data + offset, end - offset);
+        size_t bootOffset = findBootSector(image.data, end, offset);
+
+        if (bootOffset == end) {
+            offset = end;
+            continue;
+        }
+
+        cache.load(image.data + bootOffset, 512, true);
+        bootOffsets.push_back(bootOffset);
+
+        // Skip the volume, just like findVolumes does
+        offset = bootOffset + std::max(getVolumeSize(*(BPB *)(image.data +
+                                                              bootOffset)),
+                                       (size_t)512);
+        offset = std::min((offset + 511) / 512 * 512, image.size);
+    }
+
+    std::vector<Fat12Volume> fat12Volumes;
+
+    for (size_t bootOffset : bootOffsets) {
+        size_t metadataSize =
+            getMetadataSize(*(BPB *)(image.data + bootOffset));
+
+        if (metadataSize > image.size - bootOffset) {
+            printf("Volume size greater than remaining buffer\n");
+            printf("Skip volume at 0x%zX\n", bootOffset);
+            continue;
+        }
+
+        cache.load(image.data + bootOffset, metadataSize, true);
+
+        try {
+            fat12Volumes.push_back(
+                getFatVolumeAt(image.data, image.size, bootOffset, &dirty));
+        } catch (int) {
+            printf("Skip volume at 0x%zX\n", bootOffset);
+            continue;
+        }
+
+        fat12Volumes.back().dataRegion.cache = &cache;
+    }
+
+    if (fat12Volumes.empty()) {
+        printf("\n");
+        printf("No valid location found\n");
+        throw -1;
+    }
+
+    return fat12Volumes;
+}
+
 class FuseArgs {
   public:
     struct fuse_args args;
@@ -1643,6 +2528,47 @@ class FuseArgs {
     ~FuseArgs() { fuse_opt_free_args(&args); }
 };
 
+// Options specific to hdifuse, passed via -o
+struct HdiOptions {
+    int readOnly;
+    int journal;
+    unsigned int checkpointInterval;
+    unsigned long checkpointDirty;
+    unsigned long cacheSize;
+};
+
+static const struct fuse_opt hdiOptionSpec[] = {
+    {"ro", offsetof(HdiOptions, readOnly), 1},
+    {"journal", offsetof(HdiOptions, journal), 1},
+    {"checkpoint=%u", offsetof(HdiOptions, checkpointInterval), 0},
+    {"checkpoint_dirty=%lu", offsetof(HdiOptions, checkpointDirty), 0},
+    {"cache=%lu", offsetof(HdiOptions, cacheSize), 0},
+    FUSE_OPT_END};
+
+static void printHdiOptions() {
+    printf("HDI options:\n");
+    printf("    -o ro                  mount read-only. The image is shared "
+           "with other\n"
+           "                           mounts of it and never written\n");
+    printf("    -o journal             update the image in place through a "
+           "write-ahead\n"
+           "                           journal instead of replacing it with a "
+           "shadow copy\n");
+    printf("    -o checkpoint=SECONDS  write changes to the image every "
+           "SECONDS while\n"
+           "                           mounted\n");
+    printf("    -o checkpoint_dirty=BYTES\n"
+           "                           write changes to the image as soon as "
+           "BYTES are\n"
+           "                           modified\n");
+    printf("    -o cache=BYTES         read clusters from the image as they "
+           "are\n"
+           "                           accessed, keeping about BYTES of them "
+           "in memory,\n"
+           "                           instead of mapping the complete "
+           "image\n");
+}
+
 class FuseOpts {
   public:
     struct fuse_cmdline_opts opts;
@@ -1698,17 +2624,23 @@ class FuseMount {
     ~FuseMount() { fuse_session_unmount(se); }
 };
 
-static void purgeZombies(Fat12Volume &fat12Volume, Fat12Inode &parent) {
+static void purgeZombies(Fat12Inode &parent) {
+
+    for (Fat12Inode *node = parent.firstChild; node;
+         node = node->nextSibling) {
+        Fat12Inode &child = *node;
 
-    for (auto &child : parent.children) {
-        purgeZombies(fat12Volume, child);
+        purgeZombies(child);
 
         if (child.zombie) {
-            f_unlink(fat12Volume.fatRegion, child.file);
+            Fat12Volume &fat12Volume = *child.volume;
+
+            f_unlink(fat12Volume, child.file);
             child.file->filename[0] = 0xE5;
+            fat12Volume.volume.markDirty(child.file->filename, 1);
 
             cleanDirectoryFiles(parent, fat12Volume.regionBPB.bootBlock,
-                                fat12Volume.rootRegion, fat12Volume.fatRegion,
+                                fat12Volume.rootRegion, fat12Volume.fat,
                                 fat12Volume.dataRegion,
                                 fat12Volume.clusterSize);
         }
@@ -1736,11 +2668,80 @@ int main(int argc, char *argv[]) {
 
         printf("Mount %s on %s\n", filename.c_str(), argv[argc - 1]);
 
+        FuseArgs fuseArgs(argc, argv);
+        HdiOptions hdiOptions{};
+
+        if (fuse_opt_parse(&fuseArgs.args, &hdiOptions, hdiOptionSpec, 0) !=
+            0) {
+            return -1;
+        }
+
+        // ro was consumed above, but the kernel should refuse writes as well
+        if (hdiOptions.readOnly &&
+            fuse_opt_add_arg(&fuseArgs.args, "-oro") != 0) {
+            return -1;
+        }
+
+        if (hdiOptions.readOnly && hdiOptions.cacheSize) {
+            printf("Read-only mappings are read on demand already -- ignore "
+                   "cache\n");
+            hdiOptions.cacheSize = 0;
+        }
+
+        {
+            // Checkpoints are written from the daemonized process, which
+            // changes its working directory
+            char *absolute = realpath(filename.c_str(), 0);
+
+            if (!absolute) {
+                printf("Cannot resolve path of %s\n", filename.c_str());
+                return -1;
+            }
+
+            filename = absolute;
+            free(absolute);
+        }
+
+        // A journal left behind by a crash needs to be applied before the
+        // image is looked at. Read-only mounts never write the image -- the
+        // journal may as well belong to a writer still updating it
+        if (!hdiOptions.readOnly) {
+            replayJournal(filename);
+        } else if (journalExists(filename)) {
+            printf("Journal %s present -- not mounting read-only until it is "
+                   "replayed\n",
+                   getJournalFilename(filename).c_str());
+            return -1;
+        }
+
         FileDescriptorRO fd(filename.c_str());
-        auto filedata = getBuffer(fd.fd);
-        Fat12Volume fat12Volume(getFatVolume(filedata));
 
-        printf("Volume OK - Mount via fuse\n");
+        // Pages are only faulted in for the clusters actually accessed.
+        // Changes stay private to this process until they are written out
+        // below. With a cache, clean pages are given back again as well.
+        // Read-only mounts share the page cache of the image instead
+        MapMode mapMode = MAP_COPY_ON_WRITE;
+
+        if (hdiOptions.readOnly) {
+            mapMode = MAP_READ_ONLY;
+        } else if (hdiOptions.cacheSize) {
+            mapMode = MAP_ON_DEMAND;
+        }
+
+        MemoryMap image(fd.fd, mapMode);
+        DirtyMap dirty(image.data, image.size);
+        std::unique_ptr<ClusterCache> cache;
+
+        if (hdiOptions.cacheSize) {
+            cache = std::make_unique<ClusterCache>(filename, image, dirty,
+                                                   hdiOptions.cacheSize);
+        }
+
+        std::vector<Fat12Volume> fat12Volumes(
+            cache ? loadFatVolumes(*cache, image, dirty)
+                  : getFatVolumes(image.data, image.size, &dirty));
+
+        printf("%zu volume(s) OK - Mount via fuse\n", fat12Volumes.size());
         char *cwdc = get_current_dir_name();
         if (!cwdc) {
             printf("Cannot get current working directory\n");
@@ -1748,15 +2749,22 @@ int main(int argc, char *argv[]) {
         }
 
         std::string cwd(cwdc);
+        free(cwdc);
+
+        ImageWriter imageWriter(filename, image, dirty, hdiOptions.journal,
+                                cache.get());
 
         {
-            FuseContext fuseContext(fat12Volume);
+            FuseContext fuseContext(fat12Volumes, imageWriter,
+                                    hdiOptions.readOnly);
             struct fuse_lowlevel_ops fat12_ll_ops{};
 
             fat12_ll_ops.readdir = fat12_ll_readdir;
             fat12_ll_ops.write = fat12_ll_write;
+            fat12_ll_ops.fallocate = fat12_ll_fallocate;
             fat12_ll_ops.lookup = fat12_ll_lookup;
             fat12_ll_ops.getattr = fat12_ll_getattr;
+            fat12_ll_ops.statfs = fat12_ll_statfs;
             fat12_ll_ops.open = fat12_ll_open;
             fat12_ll_ops.read = fat12_ll_read;
             fat12_ll_ops.create = fat12_ll_create;
@@ -1767,8 +2775,10 @@ int main(int argc, char *argv[]) {
             fat12_ll_ops.rmdir = fat12_ll_rmdir;
             fat12_ll_ops.unlink = fat12_ll_unlink;
             fat12_ll_ops.forget = fat12_ll_forget;
+            fat12_ll_ops.flush = fat12_ll_flush;
+            fat12_ll_ops.fsync = fat12_ll_fsync;
+            fat12_ll_ops.fsyncdir = fat12_ll_fsync;
 
-            FuseArgs fuseArgs(argc, argv);
             FuseOpts fuseOpts(fuseArgs.args);
 
             if (fuseOpts.opts.show_help) {
@@ -1776,6 +2786,7 @@ int main(int argc, char *argv[]) {
                        argv[0]);
                 fuse_cmdline_help();
                 fuse_lowlevel_help();
+                printHdiOptions();
                 return 0;
             }
 
@@ -1796,36 +2807,46 @@ int main(int argc, char *argv[]) {
             FuseMount fuseMount(fuseSession.se, fuseOpts.opts.mountpoint);
 
             fuse_daemonize(fuseOpts.opts.foreground);
-            fuse_session_loop(fuseSession.se);
+
+            {
+                // Threads do not survive daemonizing, so start it afterwards
+                std::unique_ptr<CheckpointThread> checkpointThread;
+
+                if (!hdiOptions.readOnly && (hdiOptions.checkpointInterval ||
+                                             hdiOptions.checkpointDirty)) {
+                    checkpointThread = std::make_unique<CheckpointThread>(
+                        fuseContext, hdiOptions.checkpointInterval,
+                        hdiOptions.checkpointDirty);
+                }
+
+                {
+                    LockGuard lg(fuseContext.mutex);
+                    fuseContext.checkpointThread = checkpointThread.get();
+                }
+
+                fuse_session_loop(fuseSession.se);
+
+                LockGuard lg(fuseContext.mutex);
+                fuseContext.checkpointThread = 0;
+            }
 
             printf("Purge remaining entries\n");
-            purgeZombies(fat12Volume, fuseContext.rootInode);
+            purgeZombies(*fuseContext.inodes.find(FUSE_ROOT_ID));
         }
 
-        printf("Sync fat\n");
-        syncFAT(fat12Volume.regionBPB.bootBlock, fat12Volume.volume);
+        if (hdiOptions.readOnly) {
+            printf("Mounted read-only -- image is left untouched\n");
+            return 0;
+        }
 
         printf("Write file \n");
         chdir(cwd.c_str());
 
-        std::string shadowFilename = filename + ".shadow";
-        bool ret = false;
-
-        {
-            FileDescriptorWO fdwo(shadowFilename.c_str());
-            ret = pumpBuffer(filedata, fdwo.fd);
-            fsync(fdwo.fd);
-        }
-
-        if (ret) {
-            // todo: eval ret
-            rename(shadowFilename.c_str(), filename.c_str());
-            printf("Written data to image\n");
-        } else {
-            printf("Could not write shadow file\n");
+        if (!imageWriter.write(fat12Volumes)) {
             return -2;
         }
 
+        printf("Written data to image\n");
     } catch (int ex) {
         printf("Exception in main %d", ex);
         return ex;
@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -41,29 +42,39 @@ class FileDescriptorWO {
     ~FileDescriptorWO() { close(fd); }
 };
 
-static std::vector<uint8_t> getBuffer(int fd) {
-    struct stat statbuf;
-    if (fstat(fd, &statbuf) != 0) {
-        printf("Cannot open file\n");
-        throw -1;
-    }
+// hdiprint never modifies the image, so map it shared and read-only. Only the
+// pages which are actually looked at are read from disk
+class MemoryMap {
+  public:
+    uint8_t *data;
+    size_t size;
 
-    std::vector<uint8_t> buf(statbuf.st_size);
+    MemoryMap(int fd) {
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) != 0) {
+            printf("Cannot open file\n");
+            throw -1;
+        }
 
-    ssize_t hasRead = read(fd, buf.data(), buf.size());
+        size = statbuf.st_size;
 
-    if (hasRead == -1) {
-        printf("Cannot read from file\n");
-        throw -1;
-    }
+        if (size == 0) {
+            printf("File is empty\n");
+            throw -1;
+        }
 
-    if ((size_t)hasRead != buf.size()) {
-        printf("Short read from file\n");
-        throw -1;
+        void *addr = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (addr == MAP_FAILED) {
+            printf("Cannot map file\n");
+            throw -1;
+        }
+
+        data = (uint8_t *)addr;
     }
 
-    return buf;
-}
+    ~MemoryMap() { munmap(data, size); }
+};
 
 static void hexdump(uint8_t *buffer, size_t sz) {
     for (size_t i = 0; i < sz; i += 16) {
@@ -402,17 +413,17 @@ struct RegionBPB {
     Region region;
 };
 
-static RegionBPB scanForBPBRegion(std::vector<uint8_t> &buffer) {
-    if (buffer.size() + 512 < buffer.size()) {
-        printf("File is too big. Possible overflow [%zu]", buffer.size());
+static RegionBPB scanForBPBRegion(uint8_t *buffer, size_t size) {
+    if (size + 512 < size) {
+        printf("File is too big. Possible overflow [%zu]", size);
         throw -1;
     }
 
-    for (size_t i = 0; (i + 1) * 512 < buffer.size(); i++) {
+    for (size_t i = 0; (i + 1) * 512 < size; i++) {
 
         try {
 
-            BPB *bpb = (BPB *)(buffer.data() + (512 * i));
+            BPB *bpb = (BPB *)(buffer + (512 * i));
             bpb->check();
 
             size_t reservedRegionSize =
@@ -420,8 +431,7 @@ static RegionBPB scanForBPBRegion(std::vector<uint8_t> &buffer) {
 
             size_t offset = (i * 512);
 
-            return {*bpb,
-                    {buffer.data() + (i * 512), offset, reservedRegionSize}};
+            return {*bpb, {buffer + (i * 512), offset, reservedRegionSize}};
 
         } catch (...) {
         }
@@ -630,11 +640,11 @@ struct HDIHeader {
     }
 };
 
-static void checkBootHeader(std::vector<uint8_t> &data) {
+static void checkBootHeader(uint8_t *data, size_t size) {
     
     size_t nextHeader = 0;
     
-    if(data.size() < 512){
+    if(size < 512){
         printf("File too small -- Cannot parse any header\n");
         throw -1;
     }
@@ -642,7 +652,7 @@ static void checkBootHeader(std::vector<uint8_t> &data) {
     try{
         //TODO: Check data size
         
-        HDIHeader& hdr = (HDIHeader&) *(data.data());
+        HDIHeader& hdr = (HDIHeader&) *data;
         hdr.check();
         
         
@@ -653,12 +663,12 @@ static void checkBootHeader(std::vector<uint8_t> &data) {
     }
     
     printf("NextHeader 0x%zX\n", nextHeader);
-    printf("FE: %#hhx\n", *(data.data() + nextHeader + 0x0FE));
-    printf("FF: %#hhx\n", *(data.data() + nextHeader + 0x0FF));
+    printf("FE: %#hhx\n", *(data + nextHeader + 0x0FE));
+    printf("FF: %#hhx\n", *(data + nextHeader + 0x0FF));
     
     if(
-            (*(data.data() + nextHeader + 0x0FE) == 0x55) &&
-            (*(data.data() + nextHeader + 0x0FF) == 0xAA)
+            (*(data + nextHeader + 0x0FE) == 0x55) &&
+            (*(data + nextHeader + 0x0FF) == 0xAA)
             
      ){
         printf("Header OK");
@@ -678,12 +688,12 @@ int main(int argc, char *argv[]) {
     try {
         FileDescriptorRO fd(argv[1]);
 
-        auto filedata = getBuffer(fd.fd);
+        MemoryMap image(fd.fd);
 
-        printf("Process buffer %zu\n", filedata.size());
+        printf("Process buffer %zu\n", image.size);
 
         try{
-            checkBootHeader(filedata);
+            checkBootHeader(image.data, image.size);
         }
         catch(...){
             printf("No HDI Boot header found\n");
@@ -692,7 +702,7 @@ int main(int argc, char *argv[]) {
         {
             // Volume starts here as well
             
-            auto regionBPB = scanForBPBRegion(filedata);
+            auto regionBPB = scanForBPBRegion(image.data, image.size);
             printf("Boot Region %#zX, size %#zX\n", regionBPB.region.offset,
                    regionBPB.region.size);
 
@@ -702,10 +712,9 @@ int main(int argc, char *argv[]) {
                                     ? bpb.totalSectors16 * bpb.bytesPerSector
                                     : bpb.totalSectors32 * bpb.bytesPerSector;
 
-            Volume volume{filedata.data() + regionBPB.region.offset,
-                          volumeSize};
+            Volume volume{image.data + regionBPB.region.offset, volumeSize};
 
-            size_t remainingBufferSize = filedata.size() - regionBPB.region.offset;
+            size_t remainingBufferSize = image.size - regionBPB.region.offset;
 
             printf("Volume starts at %#zX, size %#zX\n", regionBPB.region.offset,
                    volumeSize);
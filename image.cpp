@@ -0,0 +1,125 @@
+#include "image.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+static bool getHDIHeader(const uint8_t *data, size_t size, size_t imageSize,
+                         HDIHeader &header) {
+    if (size < sizeof(header)) {
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+
+    uint32_t bytesPerSector = header.bytesPerSector;
+
+    if (bytesPerSector != 256 && bytesPerSector != 512 &&
+        bytesPerSector != 1024 && bytesPerSector != 2048 &&
+        bytesPerSector != 4096) {
+        return false;
+    }
+
+    return header.reserved == 0 && header.hdrSize >= sizeof(header) &&
+           header.sectors && header.heads &&
+           (size_t)header.hdrSize + header.dataSize <= imageSize;
+}
+
+static void addCandidate(std::vector<size_t> &candidates, size_t offset,
+                         size_t imageSize) {
+    if (offset > imageSize || imageSize - offset < 512) {
+        return;
+    }
+
+    if (std::find(candidates.begin(), candidates.end(), offset) ==
+        candidates.end()) {
+        candidates.push_back(offset);
+    }
+}
+
+static void addPC98Partitions(const uint8_t *data, size_t size,
+                              size_t imageSize, const HDIHeader &header,
+                              std::vector<size_t> &candidates) {
+    size_t bytesPerSector = header.bytesPerSector;
+    size_t tableOffset = header.hdrSize + std::max(bytesPerSector, (size_t)512);
+
+    if (tableOffset > size ||
+        size - tableOffset < 16 * sizeof(PC98Partition)) {
+        return;
+    }
+
+    for (size_t i = 0; i < 16; i++) {
+        PC98Partition partition;
+        memcpy(&partition, data + tableOffset + i * sizeof(partition),
+               sizeof(partition));
+
+        if (!partition.mid && !partition.sid) {
+            continue;
+        }
+
+        size_t sector = ((size_t)partition.startCylinder * header.heads +
+                         partition.startHead) *
+                            header.sectors +
+                        partition.startSector;
+
+        if (sector) {
+            addCandidate(candidates,
+                         header.hdrSize + sector * bytesPerSector, imageSize);
+        }
+    }
+}
+
+static void addMBRPartitions(const uint8_t *data, size_t size,
+                             size_t imageSize, size_t diskOffset,
+                             size_t bytesPerSector,
+                             std::vector<size_t> &candidates) {
+    if (diskOffset > size || size - diskOffset < 512) {
+        return;
+    }
+
+    const uint8_t *mbr = data + diskOffset;
+
+    if (mbr[510] != 0x55 || mbr[511] != 0xAA) {
+        return;
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        MBRPartition partition;
+        memcpy(&partition, mbr + 0x1BE + i * sizeof(partition),
+               sizeof(partition));
+
+        if ((partition.status & 0x7F) || !partition.type ||
+            !partition.lbaFirst) {
+            continue;
+        }
+
+        addCandidate(candidates,
+                     diskOffset + (size_t)partition.lbaFirst * bytesPerSector,
+                     imageSize);
+    }
+}
+
+std::vector<size_t> getVolumeCandidates(const uint8_t *data, size_t size,
+                                        size_t imageSize) {
+    std::vector<size_t> candidates;
+
+    HDIHeader header;
+    bool hasHeader = getHDIHeader(data, size, imageSize, header);
+
+    size_t diskOffset = hasHeader ? (size_t)header.hdrSize : 0;
+    size_t bytesPerSector = hasHeader ? (size_t)header.bytesPerSector : 512;
+
+    // Floppy images have no partition table
+    addCandidate(candidates, diskOffset, imageSize);
+
+    // The geometry for the PC-98 table only comes with the HDI header
+    if (hasHeader) {
+        addPC98Partitions(data, size, imageSize, header, candidates);
+    }
+
+    addMBRPartitions(data, size, imageSize, diskOffset, bytesPerSector,
+                     candidates);
+
+    return candidates;
+}
@@ -0,0 +1,59 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "fat12.h"
+
+// Layout of the disk image around the volumes: the HDI header followed by
+// the disk, which starts with either a PC-98 or a PC/AT (MBR) partition
+// table -- or with the volume itself in case of floppy images
+
+struct __attribute__((__packed__)) HDIHeader {
+    UINT32LE reserved;
+    UINT32LE type;
+    UINT32LE hdrSize;
+    UINT32LE dataSize;
+    UINT32LE bytesPerSector;
+    UINT32LE sectors;
+    UINT32LE heads;
+    UINT32LE cylinders;
+};
+
+// Sector 1 of a PC-98 disk holds up to 16 of these. Sectors count from 0
+struct __attribute__((__packed__)) PC98Partition {
+    uint8_t mid;
+    uint8_t sid;
+    uint8_t dummy[2];
+    uint8_t iplSector;
+    uint8_t iplHead;
+    UINT16LE iplCylinder;
+    uint8_t startSector;
+    uint8_t startHead;
+    UINT16LE startCylinder;
+    uint8_t endSector;
+    uint8_t endHead;
+    UINT16LE endCylinder;
+    uint8_t name[16];
+};
+
+struct __attribute__((__packed__)) MBRPartition {
+    uint8_t status;
+    uint8_t chsFirst[3];
+    uint8_t type;
+    uint8_t chsLast[3];
+    UINT32LE lbaFirst;
+    UINT32LE sectorCount;
+};
+
+// Offsets at which the image layout says a volume starts, in the order of
+// the partition tables. Each still needs to be checked with isBootSector.
+// Only the first size bytes of data are looked at, all offsets are within
+// imageSize
+std::vector<size_t> getVolumeCandidates(const uint8_t *data, size_t size,
+                                        size_t imageSize);
+
+#endif // IMAGE_H
@@ -0,0 +1,383 @@
+#include "journal.h"
+#include "util.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+// Layout:
+//   JournalHeader
+//   recordCount * (JournalRecord + data)
+//   JournalCommit
+// All integers are little endian
+
+static const uint8_t journalMagic[8]{'H', 'D', 'I', 'J', 'R', 'N', 'L', '1'};
+static const uint8_t commitMagic[8]{'H', 'D', 'I', 'C', 'M', 'M', 'T', '1'};
+
+struct __attribute__((__packed__)) JournalHeader {
+    uint8_t magic[8];
+    uint64_t imageSize;
+    uint32_t recordCount;
+    // Checksum over all of the fields above
+    uint32_t crc;
+};
+
+struct __attribute__((__packed__)) JournalRecord {
+    uint64_t offset;
+    uint32_t size;
+    // Checksum over the data following this record
+    uint32_t crc;
+};
+
+struct __attribute__((__packed__)) JournalCommit {
+    uint8_t magic[8];
+    uint32_t recordCount;
+    // Checksum over all record headers
+    uint32_t crc;
+};
+
+std::string getJournalFilename(const std::string &filename) {
+    return filename + ".journal";
+}
+
+static void append(std::vector<uint8_t> &buffer, const void *data, size_t sz) {
+    buffer.insert(buffer.end(), (const uint8_t *)data,
+                  (const uint8_t *)data + sz);
+}
+
+static bool readComplete(int fd, std::vector<uint8_t> &buffer) {
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0) {
+        return false;
+    }
+
+    buffer.resize(statbuf.st_size);
+
+    size_t hasRead = 0;
+
+    while (hasRead != buffer.size()) {
+        ssize_t rd = read(fd, buffer.data() + hasRead, buffer.size() - hasRead);
+
+        if (rd < 0 && (errno == EAGAIN || errno == EINTR)) {
+            continue;
+        }
+
+        if (rd <= 0) {
+            return false;
+        }
+
+        hasRead += (size_t)rd;
+    }
+
+    return true;
+}
+
+// Returns the parsed ranges, or false if the journal is torn or corrupt
+static bool parseJournal(const std::vector<uint8_t> &journal, size_t imageSize,
+                         std::vector<DirtyRange> &ranges,
+                         std::vector<const uint8_t *> &data) {
+    size_t pos = 0;
+
+    if (journal.size() < sizeof(JournalHeader)) {
+        printf("Journal too short for a header\n");
+        return false;
+    }
+
+    JournalHeader header;
+    memcpy(&header, journal.data(), sizeof(header));
+    pos += sizeof(header);
+
+    if (memcmp(header.magic, journalMagic, sizeof(journalMagic)) != 0) {
+        printf("Journal magic invalid\n");
+        return false;
+    }
+
+    if (crc32((const uint8_t *)&header, offsetof(JournalHeader, crc)) !=
+        le32toh(header.crc)) {
+        printf("Journal header checksum mismatch\n");
+        return false;
+    }
+
+    if (le64toh(header.imageSize) != imageSize) {
+        printf("Journal was written for an image of size %zu, image has %zu\n",
+               (size_t)le64toh(header.imageSize), imageSize);
+        throw -1;
+    }
+
+    uint32_t recordCount = le32toh(header.recordCount);
+    uint32_t recordCrc = 0;
+
+    for (uint32_t i = 0; i < recordCount; i++) {
+        if (journal.size() - pos < sizeof(JournalRecord)) {
+            printf("Journal record %u is incomplete\n", i);
+            return false;
+        }
+
+        JournalRecord record;
+        memcpy(&record, journal.data() + pos, sizeof(record));
+        recordCrc = crc32((const uint8_t *)&record, sizeof(record), recordCrc);
+        pos += sizeof(record);
+
+        size_t offset = le64toh(record.offset);
+        size_t sz = le32toh(record.size);
+
+        if (journal.size() - pos < sz) {
+            printf("Journal record %u data is incomplete\n", i);
+            return false;
+        }
+
+        if (offset > imageSize || sz > imageSize - offset) {
+            printf("Journal record %u is outside of the image\n", i);
+            return false;
+        }
+
+        if (crc32(journal.data() + pos, sz) != le32toh(record.crc)) {
+            printf("Journal record %u checksum mismatch\n", i);
+            return false;
+        }
+
+        ranges.push_back({offset, sz});
+        data.push_back(journal.data() + pos);
+        pos += sz;
+    }
+
+    if (journal.size() - pos < sizeof(JournalCommit)) {
+        printf("Journal has no commit record\n");
+        return false;
+    }
+
+    JournalCommit commit;
+    memcpy(&commit, journal.data() + pos, sizeof(commit));
+
+    if (memcmp(commit.magic, commitMagic, sizeof(commitMagic)) != 0 ||
+        le32toh(commit.recordCount) != recordCount ||
+        le32toh(commit.crc) != recordCrc) {
+        printf("Journal commit record invalid\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool journalExists(const std::string &filename) {
+    struct stat statbuf;
+
+    return stat(getJournalFilename(filename).c_str(), &statbuf) == 0;
+}
+
+void replayJournal(const std::string &filename) {
+    std::string journalFilename = getJournalFilename(filename);
+
+    if (!journalExists(filename)) {
+        return;
+    }
+
+    int fd = open(filename.c_str(), O_RDWR);
+
+    if (fd == -1) {
+        printf("Cannot open %s for replaying the journal\n", filename.c_str());
+        throw -1;
+    }
+
+    try {
+        // Held by writeBackJournaled until its journal is gone again. A
+        // journal found after getting the lock is left over from a crash
+        if (flock(fd, LOCK_EX) != 0) {
+            printf("Cannot lock %s, errno %d\n", filename.c_str(), errno);
+            throw -1;
+        }
+
+        int jfd = open(journalFilename.c_str(), O_RDONLY);
+
+        if (jfd == -1) {
+            if (errno == ENOENT) {
+                close(fd);
+                return;
+            }
+
+            printf("Cannot open journal %s, errno %d\n",
+                   journalFilename.c_str(), errno);
+            throw -1;
+        }
+
+        std::vector<uint8_t> journal;
+        bool ret = readComplete(jfd, journal);
+        close(jfd);
+
+        if (!ret) {
+            printf("Cannot read journal %s\n", journalFilename.c_str());
+            throw -1;
+        }
+
+        struct stat statbuf;
+        if (fstat(fd, &statbuf) != 0) {
+            throw -1;
+        }
+
+        std::vector<DirtyRange> ranges;
+        std::vector<const uint8_t *> data;
+
+        if (parseJournal(journal, statbuf.st_size, ranges, data)) {
+            printf("Replay journal %s, %zu ranges\n", journalFilename.c_str(),
+                   ranges.size());
+
+            for (size_t i = 0; i < ranges.size(); i++) {
+                if (!pwriteBuffer(data[i], ranges[i].size, ranges[i].offset,
+                                  fd)) {
+                    printf("Cannot write journal range to image\n");
+                    throw -1;
+                }
+            }
+
+            if (fsync(fd) != 0) {
+                printf("Cannot sync image after replaying the journal\n");
+                throw -1;
+            }
+        } else {
+            // The journal was not completely written, so the image itself
+            // was never modified
+            printf("Drop incomplete journal %s\n", journalFilename.c_str());
+        }
+
+        unlink(journalFilename.c_str());
+        syncDirectory(journalFilename);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+static bool writeJournal(const std::string &journalFilename,
+                         const std::vector<uint8_t> &journal) {
+    int jfd = open(journalFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                   S_IRUSR | S_IWUSR);
+
+    if (jfd == -1) {
+        printf("Cannot create journal %s, errno %d\n", journalFilename.c_str(),
+               errno);
+        return false;
+    }
+
+    bool ret =
+        pumpBuffer(journal.data(), journal.size(), jfd) && fsync(jfd) == 0;
+    close(jfd);
+
+    if (!ret) {
+        printf("Cannot write journal\n");
+        unlink(journalFilename.c_str());
+        return false;
+    }
+
+    syncDirectory(journalFilename);
+
+    return true;
+}
+
+bool writeBackJournaled(const std::string &filename, const uint8_t *buffer,
+                        size_t size, DirtyMap &dirty) {
+    if (dirty.empty()) {
+        printf("No changes -- image is left untouched\n");
+        return true;
+    }
+
+    const auto &ranges = dirty.getRanges();
+    printf("Journal %zu bytes in %zu ranges\n", dirty.dirtyBytes(),
+           ranges.size());
+
+    // A record holds at most UINT32_MAX bytes, so longer ranges are split
+    std::vector<DirtyRange> records;
+
+    for (const DirtyRange &range : ranges) {
+        for (size_t done = 0; done != range.size;) {
+            size_t part = std::min(range.size - done, (size_t)UINT32_MAX);
+            records.push_back({range.offset + done, part});
+            done += part;
+        }
+    }
+
+    std::vector<uint8_t> journal;
+    journal.reserve(sizeof(JournalHeader) + sizeof(JournalCommit) +
+                    records.size() * sizeof(JournalRecord) +
+                    dirty.dirtyBytes());
+
+    JournalHeader header;
+    memcpy(header.magic, journalMagic, sizeof(journalMagic));
+    header.imageSize = htole64(size);
+    header.recordCount = htole32(records.size());
+    header.crc =
+        htole32(crc32((const uint8_t *)&header, offsetof(JournalHeader, crc)));
+    append(journal, &header, sizeof(header));
+
+    uint32_t recordCrc = 0;
+
+    for (const DirtyRange &range : records) {
+        JournalRecord record;
+        record.offset = htole64(range.offset);
+        record.size = htole32(range.size);
+        record.crc = htole32(crc32(buffer + range.offset, range.size));
+
+        recordCrc = crc32((const uint8_t *)&record, sizeof(record), recordCrc);
+
+        append(journal, &record, sizeof(record));
+        append(journal, buffer + range.offset, range.size);
+    }
+
+    JournalCommit commit;
+    memcpy(commit.magic, commitMagic, sizeof(commitMagic));
+    commit.recordCount = htole32(records.size());
+    commit.crc = htole32(recordCrc);
+    append(journal, &commit, sizeof(commit));
+
+    std::string journalFilename = getJournalFilename(filename);
+
+    int fd = open(filename.c_str(), O_RDWR);
+
+    if (fd == -1) {
+        printf("Cannot open %s for writing, errno %d\n", filename.c_str(),
+               errno);
+        return false;
+    }
+
+    // Keeps replayJournal in other processes from taking the journal for
+    // one left over from a crash while it is written and applied
+    if (flock(fd, LOCK_EX) != 0) {
+        printf("Cannot lock %s, errno %d\n", filename.c_str(), errno);
+        close(fd);
+        return false;
+    }
+
+    if (!writeJournal(journalFilename, journal)) {
+        close(fd);
+        return false;
+    }
+
+    // From here on the changes survive a crash -- they are replayed from the
+    // journal on the next start if the in-place update does not finish
+
+    bool ret = writeRanges(buffer, ranges, fd) && fsync(fd) == 0;
+
+    if (!ret) {
+        printf("Cannot update image in place -- journal is kept for replay\n");
+        close(fd);
+        return false;
+    }
+
+    unlink(journalFilename.c_str());
+    syncDirectory(journalFilename);
+    close(fd);
+
+    dirty.clear();
+
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include "file.h"
+
+// Sidecar write-ahead journal (<image>.journal) for updating an image in
+// place. All dirty ranges are first written to the journal together with
+// their checksums and a commit record. Only after the journal is on disk
+// the ranges are written to the image itself, after which the journal is
+// removed. A journal which is still present on the next start is replayed
+// if it is complete, or dropped if it is not -- in that case the image was
+// never touched.
+
+std::string getJournalFilename(const std::string &filename);
+
+// Whether a journal is present, i.e. one which still needs to be replayed
+// or one which is being written right now
+bool journalExists(const std::string &filename);
+
+void replayJournal(const std::string &filename);
+
+bool writeBackJournaled(const std::string &filename, const uint8_t *buffer,
+                        size_t size, DirtyMap &dirty);
+
+#endif // JOURNAL_H
@@ -0,0 +1,176 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+
+// Calls to io_uring_enter in a row that may take nothing before giving up
+static const unsigned int maxSubmitStalls = 16;
+
+static void *mapRing(int fd, size_t size, off_t offset) {
+    void *ptr = mmap(0, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, fd, offset);
+
+    if (ptr == MAP_FAILED) {
+        printf("Cannot map io_uring, errno %d\n", errno);
+        throw -1;
+    }
+
+    return ptr;
+}
+
+IoUring::IoUring(unsigned int entries_)
+    : entries(entries_), inflight(0), queued(0), sqRing(MAP_FAILED),
+      cqRing(MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+
+    if (fd == -1) {
+        printf("io_uring is not available, errno %d\n", errno);
+        throw -1;
+    }
+
+    try {
+        // The completion queue is at least twice the size of the submission
+        // queue, so it cannot overflow as long as no more than entries reads
+        // are in flight
+        entries = params.sq_entries;
+
+        sqRingSize =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes +
+                     params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        sqRing = mapRing(fd, sqRingSize, IORING_OFF_SQ_RING);
+        cqRing = mapRing(fd, cqRingSize, IORING_OFF_CQ_RING);
+        sqes = (io_uring_sqe *)mapRing(fd, sqesSize, IORING_OFF_SQES);
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    uint8_t *sq = (uint8_t *)sqRing;
+    sqTail = (unsigned *)(sq + params.sq_off.tail);
+    sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned *)(sq + params.sq_off.array);
+
+    uint8_t *cq = (uint8_t *)cqRing;
+    cqHead = (unsigned *)(cq + params.cq_off.head);
+    cqTail = (unsigned *)(cq + params.cq_off.tail);
+    cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    localTail = *sqTail;
+}
+
+IoUring::~IoUring() { release(); }
+
+void IoUring::release() {
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqesSize);
+    }
+
+    if (cqRing != MAP_FAILED) {
+        munmap(cqRing, cqRingSize);
+    }
+
+    if (sqRing != MAP_FAILED) {
+        munmap(sqRing, sqRingSize);
+    }
+
+    close(fd);
+}
+
+bool IoUring::full() const { return inflight + queued >= entries; }
+
+void IoUring::read(int fileFd, void *buf, size_t size, size_t offset,
+                   uint64_t userData) {
+    if (full()) {
+        printf("io_uring is full\n");
+        throw EAGAIN;
+    }
+
+    unsigned int index = localTail & *sqMask;
+
+    io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fileFd;
+    sqe->addr = (uint64_t)buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    sqArray[index] = index;
+    localTail++;
+    queued++;
+}
+
+void IoUring::submit(unsigned int waitFor) {
+    // The kernel only looks at the queued entries once the tail is moved
+    __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+
+    unsigned int toSubmit = queued;
+    unsigned int flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+    unsigned int stalls = 0;
+
+    while (toSubmit || waitFor) {
+        int ret = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, flags,
+                          0, 0);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // The kernel taking nothing, over and over, will not get better
+        if (ret < 0 ? errno == EAGAIN : ret == 0 && toSubmit) {
+            if (++stalls < maxSubmitStalls) {
+                continue;
+            }
+
+            printf("io_uring_enter made no progress\n");
+            throw EIO;
+        }
+
+        if (ret < 0) {
+            printf("io_uring_enter failed, errno %d\n", errno);
+            throw EIO;
+        }
+
+        stalls = 0;
+
+        toSubmit -= std::min((unsigned int)ret, toSubmit);
+        inflight += (unsigned int)ret;
+        queued -= (unsigned int)ret;
+
+        // Completions have been waited for above, if anything was asked for
+        waitFor = 0;
+    }
+}
+
+bool IoUring::complete(uint64_t &userData, int &result) {
+    unsigned int head = *cqHead;
+
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+
+    io_uring_cqe *cqe = &cqes[head & *cqMask];
+    userData = cqe->user_data;
+    result = cqe->res;
+
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    inflight--;
+
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/io_uring.h>
+
+// Minimal io_uring for reads, set up through the raw system calls. Throws -1
+// if the kernel does not support it
+class IoUring {
+  public:
+    unsigned int entries;
+    unsigned int inflight;
+
+    IoUring(unsigned int entries_);
+    ~IoUring();
+
+    bool full() const;
+
+    // Queue a read. It is started with the next call to submit
+    void read(int fd, void *buf, size_t size, size_t offset,
+              uint64_t userData);
+
+    // Start all queued reads and wait until at least waitFor have completed
+    void submit(unsigned int waitFor);
+
+    // Pop a completed read, if there is one
+    bool complete(uint64_t &userData, int &result);
+
+  private:
+    int fd;
+    unsigned int queued;
+    unsigned int localTail;
+
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqArray;
+    unsigned int *cqHead;
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    io_uring_cqe *cqes;
+
+    void release();
+};
+
+#endif // URING_H
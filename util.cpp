@@ -2,6 +2,7 @@
 
 #include <cctype>
 #include <stdio.h>
+#include <time.h>
 
 void hexdump(const uint8_t *buffer, size_t sz) {
     for (size_t i = 0; i < sz; i += 16) {
@@ -47,6 +48,34 @@ std::string hexenc(const uint8_t *buffer, size_t sz) {
     return hex;
 }
 
+// CRC-32 (IEEE 802.3), reflected, polynomial 0xEDB88320
+static uint32_t crcTable[256];
+
+static void initCrcTable() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+
+        for (int j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+
+        crcTable[i] = c;
+    }
+}
+
+uint32_t crc32(const uint8_t *buffer, size_t sz, uint32_t crc) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, initCrcTable);
+
+    crc = ~crc;
+
+    for (size_t i = 0; i < sz; i++) {
+        crc = crcTable[(crc ^ buffer[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
 LockGuard::LockGuard(Mutex &mut_) : mut(mut_) { pthread_mutex_lock(&mut.mut); }
 
 LockGuard::~LockGuard() { pthread_mutex_unlock(&mut.mut); }
@@ -54,3 +83,22 @@ LockGuard::~LockGuard() { pthread_mutex_unlock(&mut.mut); }
 Mutex::Mutex() { pthread_mutex_init(&mut, 0); }
 
 Mutex::~Mutex() { pthread_mutex_destroy(&mut); }
+
+Condition::Condition() { pthread_cond_init(&cond, 0); }
+
+Condition::~Condition() { pthread_cond_destroy(&cond); }
+
+void Condition::wait(Mutex &mut, unsigned int timeoutSeconds) {
+    if (!timeoutSeconds) {
+        pthread_cond_wait(&cond, &mut.mut);
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeoutSeconds;
+
+    pthread_cond_timedwait(&cond, &mut.mut, &deadline);
+}
+
+void Condition::signal() { pthread_cond_signal(&cond); }
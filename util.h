@@ -8,6 +8,7 @@
 
 void hexdump(const uint8_t *buffer, size_t sz);
 std::string hexenc(const uint8_t *buffer, size_t sz);
+uint32_t crc32(const uint8_t *buffer, size_t sz, uint32_t crc = 0);
 
 class Mutex {
   public:
@@ -17,6 +18,18 @@ class Mutex {
     ~Mutex();
 };
 
+class Condition {
+  public:
+    pthread_cond_t cond;
+
+    Condition();
+    ~Condition();
+
+    // Wait with the mutex held. A timeout of 0 waits until signalled
+    void wait(Mutex &mut, unsigned int timeoutSeconds);
+    void signal();
+};
+
 class LockGuard {
     Mutex &mut;
 